@@ -0,0 +1,201 @@
+#!/bin/bash
+# Runs panograph on every set in sets.txt and checks speed, memory and output quality against baselines.txt
+#
+# Usage: benchmark/benchmark.sh [--update] [--store] [set names...]
+#   --update  record the results as the new baselines instead of checking them. A set without a baseline
+#             fails the check, and a set below the quality floors below is never recorded
+#   --store   run every set twice against a fresh --feature-store, and report the cold and warm times.
+#             The warm run is the one checked against the baselines
+#
+# Environment:
+#   PANOGRAPH   binary to run (default ./panograph in the repo root)
+#   ALG PARAMS  matcher and its parameters (default FERN samples/fern_params.xml, ALG=BRIEF for the binary pipeline)
+#   OPTIONS     extra options passed on every run, e.g. "--threads 4 --pyramid 1"
+#   TIME_TOLERANCE MEM_TOLERANCE   allowed slowdown and peak RSS growth as factors (default 1.25 and 1.20)
+#   SIZE_TOLERANCE                 allowed relative change of the mosaic width or height (default 0.05)
+#   INLIER_TOLERANCE               fraction of the baseline inliers that must remain (default 0.8)
+#   PSNR_DROP SSIM_DROP            allowed quality loss against the reference image (default 1.0 dB and 0.02)
+#   MIN_PSNR MIN_SSIM              quality every set with a reference must reach, baseline or not (default 20 dB and 0.7)
+#   MIN_RECALL                     with --retrieval-check, share of images that must keep their best match (default 0.9)
+#   BLEND_COST_LIMIT               with --blend, allowed blend time per MP as a multiple of the plain warp's (default 4)
+#
+# Before the sets, --bench-warp checks that tiled warping agrees with warpPerspective on testimages/rotation.
+# Each set runs in benchmark/out/<set>, which keeps its result.jpg, summary.txt and a CSV trace of every stage.
+# Exits with 1 if any set regressed or failed to produce a result.
+
+cd "$(dirname "$0")/.." || exit 1
+ROOT=$(pwd)
+PANOGRAPH=${PANOGRAPH:-$ROOT/panograph}
+ALG=${ALG:-FERN}
+PARAMS=${PARAMS:-samples/fern_params.xml}
+TIME_TOLERANCE=${TIME_TOLERANCE:-1.25}
+MEM_TOLERANCE=${MEM_TOLERANCE:-1.20}
+SIZE_TOLERANCE=${SIZE_TOLERANCE:-0.05}
+INLIER_TOLERANCE=${INLIER_TOLERANCE:-0.8}
+PSNR_DROP=${PSNR_DROP:-1.0}
+SSIM_DROP=${SSIM_DROP:-0.02}
+MIN_PSNR=${MIN_PSNR:-20}
+MIN_SSIM=${MIN_SSIM:-0.7}
+BLEND_COST_LIMIT=${BLEND_COST_LIMIT:-4}
+MIN_RECALL=${MIN_RECALL:-0.9}
+BASELINES=benchmark/baselines.txt
+
+update=0
+store=0
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --update) update=1;;
+        --store) store=1;;
+        *) break;;
+    esac
+    shift
+done
+selected=" $* "
+
+if [ ! -x "$PANOGRAPH" ]; then
+    echo "No panograph binary at $PANOGRAPH, build it first or set PANOGRAPH"
+    exit 1
+fi
+
+# value KEY FILE: the value of KEY in a key=value summary
+value() {
+    sed -n "s/^$1=//p" "$2"
+}
+
+# check LABEL CURRENT LIMIT above|below: fails the set if CURRENT is on the wrong side of LIMIT
+check() {
+    if awk -v c="$2" -v l="$3" -v d="$4" 'BEGIN {exit !((d == "above" && c > l) || (d == "below" && c < l))}'; then
+        printf "  REGRESSION %-12s %s (limit %s)\n" "$1" "$2" "$3"
+        failed=1
+    fi
+}
+
+failures=0
+echo "== warpTiled against warpPerspective"
+"$PANOGRAPH" --bench-warp testimages/rotation/*.jpg | sed 's/^/  /'
+if [ "${PIPESTATUS[0]}" -ne 0 ]; then
+    failures=$((failures + 1))
+fi
+newBaselines=$(mktemp)
+grep -v "^#" "$BASELINES" > "$newBaselines"
+
+while IFS='|' read -r name options images; do
+    case "$name" in ""|\#*) continue;; esac
+    if [ "$selected" != "  " ] && [[ "$selected" != *" $name "* ]]; then continue; fi
+
+    out=benchmark/out/$name
+    rm -rf "$out"
+    mkdir -p "$out"
+    absImages=""
+    for image in $images; do absImages="$absImages $ROOT/$image"; done
+    absOptions=$(echo " $options" | sed "s| testimages/| $ROOT/testimages/|g")
+
+    echo "== $name ($ALG)"
+    storeOptions=""
+    if [ $store -eq 1 ]; then
+        storeOptions="--feature-store store"
+        (cd "$out" && "$PANOGRAPH" $OPTIONS $absOptions $storeOptions --summary cold_summary.txt \
+            "$ALG" "$ROOT/$PARAMS" $absImages < /dev/null > cold_log.txt 2>&1)
+    fi
+    (cd "$out" && "$PANOGRAPH" $OPTIONS $absOptions $storeOptions --trace trace.csv --trace-format csv --summary summary.txt \
+        "$ALG" "$ROOT/$PARAMS" $absImages < /dev/null > log.txt 2>&1)
+    summary=$out/summary.txt
+    if [ ! -s "$summary" ]; then
+        echo "  FAILED, no summary written (see $out/log.txt)"
+        failures=$((failures + 1))
+        continue
+    fi
+
+    seconds=$(value seconds "$summary")
+    mpPerS=$(value mp_per_s "$summary")
+    rss=$(value peak_rss_kb "$summary")
+    width=$(value mosaic_width "$summary")
+    height=$(value mosaic_height "$summary")
+    inliers=$(value inliers "$summary")
+    psnr=$(value psnr "$summary")
+    ssim=$(value ssim "$summary")
+    printf "  %.2f s, %.2f MP/s, peak RSS %d MB, mosaic %dx%d, %d inliers" "$seconds" "$mpPerS" $((rss / 1024)) "$width" "$height" "$inliers"
+    if [ "$psnr" != "-1.000" ]; then printf ", PSNR %.2f dB, SSIM %.4f" "$psnr" "$ssim"; fi
+    printf "\n"
+    warpCost=$(value warp_ms_per_mp "$summary")
+    blendCost=$(value blend_ms_per_mp "$summary")
+    blending=$(awk -v b="$blendCost" 'BEGIN {print (b > 0)}')
+    if [ "$blending" = "1" ]; then printf "  blend %.1f ms/MP against %.1f ms/MP for the plain warp\n" "$blendCost" "$warpCost"; fi
+    faults=$(value page_faults "$summary")
+    if [ -n "$faults" ]; then
+        printf "  %d page faults, buffer pool %d hits / %d misses, %.1f ms allocating, %d MB high water\n" "$faults" \
+            "$(value pool_hits "$summary")" "$(value pool_misses "$summary")" "$(value pool_alloc_ms "$summary")" $(($(value pool_high_water_kb "$summary") / 1024))
+    fi
+    if [ $store -eq 1 ] && [ -s "$out/cold_summary.txt" ]; then
+        printf "  feature store: cold %.2f s, warm %.2f s, %d feature sets and %d pair results loaded\n" \
+            "$(value seconds "$out/cold_summary.txt")" "$seconds" "$(value stored_features_loaded "$summary")" "$(value stored_pairs_loaded "$summary")"
+    fi
+    recall=$(value retrieval_recall "$summary")
+    checked=$(awk -v r="$recall" 'BEGIN {print (r != "" && r >= 0)}')
+    if [ "$checked" = "1" ]; then
+        printf "  retrieval kept %d of %d matcher calls, recall %.3f\n" "$(value matcher_calls "$summary")" "$(value exhaustive_matcher_calls "$summary")" "$recall"
+    fi
+    # Summed over threads for stages that run inside parallel loops
+    awk -F, 'NR > 1 {wall[$1] += $5; count[$1]++} END {for (s in wall) printf "    %-22s %4d x %10.1f ms\n", s, count[s], wall[s]}' "$out/trace.csv" | sort
+
+    failed=0
+    if [ "$psnr" != "-1.000" ]; then
+        check psnr "$psnr" "$MIN_PSNR" below
+        check ssim "$ssim" "$MIN_SSIM" below
+    fi
+
+    if [ $update -eq 1 ]; then
+        if [ $failed -eq 1 ]; then
+            echo "  Not recorded, the result is below the quality floor"
+            failures=$((failures + 1))
+            continue
+        fi
+        grep -v "^$name $ALG " "$newBaselines" > "$newBaselines.tmp"
+        echo "$name $ALG $seconds $mpPerS $rss $width $height $inliers $psnr $ssim" >> "$newBaselines.tmp"
+        mv "$newBaselines.tmp" "$newBaselines"
+        continue
+    fi
+
+    baseline=$(grep "^$name $ALG " "$newBaselines")
+    if [ -z "$baseline" ]; then
+        echo "  FAILED, no baseline for $name with $ALG, record one with --update"
+        failures=$((failures + 1))
+        continue
+    fi
+    read -r _ _ bSeconds _ bRss bWidth bHeight bInliers bPsnr bSsim <<< "$baseline"
+    if [ "$checked" = "1" ]; then
+        check retrieval_recall "$recall" "$MIN_RECALL" below
+    fi
+    if [ "$blending" = "1" ]; then
+        check blend_ms_per_mp "$blendCost" "$(awk -v w="$warpCost" -v l="$BLEND_COST_LIMIT" 'BEGIN {print w * l}')" above
+    fi
+    check seconds "$seconds" "$(awk -v b="$bSeconds" -v t="$TIME_TOLERANCE" 'BEGIN {print b * t}')" above
+    check peak_rss_kb "$rss" "$(awk -v b="$bRss" -v t="$MEM_TOLERANCE" 'BEGIN {print b * t}')" above
+    check mosaic_width "$width" "$(awk -v b="$bWidth" -v t="$SIZE_TOLERANCE" 'BEGIN {print b * (1 + t)}')" above
+    check mosaic_width "$width" "$(awk -v b="$bWidth" -v t="$SIZE_TOLERANCE" 'BEGIN {print b * (1 - t)}')" below
+    check mosaic_height "$height" "$(awk -v b="$bHeight" -v t="$SIZE_TOLERANCE" 'BEGIN {print b * (1 + t)}')" above
+    check mosaic_height "$height" "$(awk -v b="$bHeight" -v t="$SIZE_TOLERANCE" 'BEGIN {print b * (1 - t)}')" below
+    check inliers "$inliers" "$(awk -v b="$bInliers" -v t="$INLIER_TOLERANCE" 'BEGIN {print b * t}')" below
+    if [ "$bPsnr" != "-1.000" ]; then
+        check psnr "$psnr" "$(awk -v b="$bPsnr" -v d="$PSNR_DROP" 'BEGIN {print b - d}')" below
+        check ssim "$ssim" "$(awk -v b="$bSsim" -v d="$SSIM_DROP" 'BEGIN {print b - d}')" below
+    fi
+    if [ $failed -eq 1 ]; then
+        failures=$((failures + 1))
+    else
+        echo "  OK against baseline ($bSeconds s, peak RSS $((bRss / 1024)) MB)"
+    fi
+done < benchmark/sets.txt
+
+if [ $update -eq 1 ]; then
+    { grep "^#" "$BASELINES"; sort "$newBaselines"; } > "$BASELINES.tmp"
+    mv "$BASELINES.tmp" "$BASELINES"
+    echo "Baselines written to $BASELINES"
+fi
+rm -f "$newBaselines"
+
+if [ $failures -gt 0 ]; then
+    echo "$failures set(s) regressed or have no baseline"
+    exit 1
+fi
+echo "All sets passed"
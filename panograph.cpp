@@ -3,27 +3,623 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
+#include <algorithm>
+#include <cfloat>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace cv;
 
-Mat stitchImages(Mat img1, Mat img2, Mat img1rgb, Mat img2rgb, Ptr<GenericDescriptorMatcher> descriptorMatcher);
-Mat cropBlack(Mat toCrop, Mat toCropGray);
+//How the final mosaic is cropped
+enum CropMode {
+    CROP_NONE,      //Keep the whole canvas
+    CROP_BOUNDING,  //Bounding box of the non-black pixels
+    CROP_INSCRIBED  //Largest rectangle with no black pixels in it, removes the wedges left by perspective warps
+};
+
+//Surface the input frames are projected onto before matching. On a cylinder or sphere, frames of a camera turning
+//about its centre only shift against each other, so the canvas grows linearly with the sweep angle
+enum ProjectionMode {
+    PROJECTION_PLANE,        //Use the frames as they are, chained homographies stretch towards the ends of a long sweep
+    PROJECTION_CYLINDRICAL,  //For sweeps around a vertical axis
+    PROJECTION_SPHERICAL     //For sweeps that also tilt up or down
+};
+
+//How a newly warped image is composited onto the mosaic
+enum BlendMode {
+    BLEND_NONE,      //Warped pixels overwrite the mosaic
+    BLEND_MULTIBAND  //Gain compensation, then a Laplacian pyramid blend across a seam between the two images
+};
+
+//A read only file mapping from the feature store, unmapped when the last Ptr to it goes away
+struct StoreMapping {
+    const uchar* data;
+    size_t size;
+    StoreMapping(const uchar* data, size_t size) : data(data), size(size) {}
+    ~StoreMapping() {munmap((void*)data, size);}
+};
+
+//Keypoints (and descriptors, once something has asked for them) extracted from one image at one SURF threshold
+//and pyramid level. Keypoint coordinates are in that level's pixels
+//model is a copy of the generic matcher already trained on these keypoints, so matching against this image
+//doesn't retrain it every time
+//mapping is set when the descriptors point into a feature store file, and keeps it mapped for as long as this set
+//or a copy of it is around
+//descriptorsComputed tells a set whose descriptors were asked for apart from one that only has keypoints, since the
+//descriptors of an image without keypoints stay empty
+struct FeatureSet {
+    FeatureSet() : descriptorsComputed(false) {}
+    vector<KeyPoint> keypoints;
+    Mat descriptors;
+    bool descriptorsComputed;
+    Ptr<GenericDescriptorMatcher> model;
+    Ptr<StoreMapping> mapping;
+};
+
+//FernDescriptorMatcher::write and read only cover the parameters, so a model read back would be trained again.
+//This one also saves the trained classifier, which is what --model-cache needs
+class CachedFernMatcher : public FernDescriptorMatcher {
+public:
+    CachedFernMatcher(const Params& params = Params()) : FernDescriptorMatcher(params) {}
+    virtual void write(FileStorage& fs) const {
+        FernDescriptorMatcher::write(fs);
+        if (!classifier.empty()) {
+            classifier->write(fs, "classifier");
+        }
+    }
+    //Takes the classifier saved in fn as the one trained on the keypoints added so far. False if fn has none, or if
+    //it was trained with other parameters than this matcher's
+    bool readClassifier(const FileNode& fn) {
+        FileNode node = fn["classifier"];
+        if (node.empty()) {
+            return false;
+        }
+        CachedFernMatcher saved;
+        saved.FernDescriptorMatcher::read(fn);
+        const Params& s = saved.params;
+        if (s.nclasses != params.nclasses || s.patchSize != params.patchSize || s.signatureSize != params.signatureSize ||
+            s.nstructs != params.nstructs || s.structSize != params.structSize || s.nviews != params.nviews ||
+            s.compressionMethod != params.compressionMethod) {
+            return false;
+        }
+        classifier = new FernClassifier();
+        classifier->read(node);
+        //train() builds a new classifier whenever more keypoints were added than the last one saw
+        prevTrainCount = (int)trainPointCollection.keypointCount();
+        return true;
+    }
+    virtual Ptr<GenericDescriptorMatcher> clone(bool emptyTrainData = false) const {
+        if (!emptyTrainData) {
+            //Fails the same way, a trained classifier can't be copied
+            return FernDescriptorMatcher::clone(false);
+        }
+        return new CachedFernMatcher(params);
+    }
+};
+
+//SURF threshold and pyramid level
+typedef std::pair<double, int> FeatureKey;
+
+//One finished stage of the trace. stitch is the main loop iteration it belongs to (-1 outside the loop),
+//times are in ms from the start of the run, cpuMs is thread CPU time inside parallel loops and process CPU time outside
+struct StageRecord {
+    std::string name;
+    int stitch;
+    int thread;
+    double startMs;
+    double wallMs;
+    double cpuMs;
+    long peakRSSKB;
+    long pageFaults;
+    vector<std::pair<std::string, double> > values;
+};
+
+//Times a stage from construction to destruction and adds it to the trace along with any counters set on it
+class ScopedStage {
+public:
+    ScopedStage(const char* name);
+    ~ScopedStage();
+    void set(const char* key, double value);
+private:
+    StageRecord record;
+    int64 startTicks;
+    double startCpuMs;
+    long startFaults;
+};
+
+//Trace file formats for --trace-format
+enum TraceFormat {
+    TRACE_JSON,
+    TRACE_CSV,
+    TRACE_CHROME  //Chrome's trace event format, load it in chrome://tracing
+};
+
+Mat stitchImages(int index1, int index2, vector<Mat>& imgs, vector<Mat>& imgs_rgb, Ptr<GenericDescriptorMatcher> descriptorMatcher);
+Mat cropBlack(Mat toCrop, Mat toCropGray, int mode = CROP_BOUNDING);
+Rect nonZeroBounds(const Mat& gray);
+Rect largestInscribedRect(const Mat& gray);
+void benchmarkCrop(const vector<std::string>& imgNames);
+int benchmarkWarp(const vector<std::string>& imgNames);
 vector<int> findBestMatch(vector<Mat> imgs, Ptr<GenericDescriptorMatcher> descriptorMatcher);
+void markStitched(int index1, int index2);
+Mat retrievalCandidates(const vector<Mat>& imgs);
+bool validateHomography(const Mat& H, const vector<uchar>& inlierMask, Size size1);
+Mat findPairHomography(Mat img1, Mat img2, FeatureSet& features1, FeatureSet& features2, Ptr<GenericDescriptorMatcher> descriptorMatcher, vector<Point2f>& points1, vector<Point2f>& points2, vector<uchar>& inlierMask);
+void matchFeatures(const Mat& img1, FeatureSet& features1, const Mat& img2, FeatureSet& features2, Ptr<GenericDescriptorMatcher> descriptorMatcher, vector<DMatch>& matches1to2);
+void hammingMatch(const Mat& queryDescriptors, const Mat& trainDescriptors, vector<DMatch>& matches);
+void filterMatches(const Mat& img1, FeatureSet& features1, const Mat& img2, FeatureSet& features2, Ptr<GenericDescriptorMatcher> descriptorMatcher, vector<DMatch>& matches);
+Mat robustHomography(const vector<Point2f>& points1, const vector<Point2f>& points2, double threshold, vector<uchar>& inlierMask);
+void guidedMatch(const vector<KeyPoint>& queryKeypoints, const Mat& queryDescriptors, const vector<KeyPoint>& trainKeypoints, const Mat& trainDescriptors, const Mat& H, float radius, vector<DMatch>& matches);
+Mat guidedHomography(const vector<Mat>& imgs, int index1, int index2, const Mat& coarseH, float radius, vector<Point2f>& points1, vector<Point2f>& points2, vector<uchar>& inlierMask);
+Mat estimateHomography(const vector<Mat>& imgs, int index1, int index2, Ptr<GenericDescriptorMatcher> descriptorMatcher, vector<Point2f>& points1, vector<Point2f>& points2, vector<uchar>& inlierMask);
+Mat refineHomography(const Mat& img1, const Mat& img2, const Mat& H, const vector<Point2f>& coarsePoints1, const vector<uchar>& coarseInliers, int searchRadius, vector<Point2f>& points1, vector<Point2f>& points2, vector<uchar>& inlierMask);
+double reprojectionError(const vector<Point2f>& points1, const vector<Point2f>& points2, const Mat& H, const vector<uchar>& inlierMask);
+Mat stitchGlobal(vector<Mat>& imgs, vector<Mat>& imgs_rgb, Ptr<GenericDescriptorMatcher> descriptorMatcher);
+Rect projectedBounds(Size size, const Mat& H);
+void warpTiled(const Mat& src, Mat& dst, const Mat& H);
+void blendInto(const Mat& src, Mat& dst, const Mat& H, Point2f centre);
+bool sourceRegion(Size srcSize, const Mat& Hinv, Rect tile, Rect& region);
+void compositeTiles(const vector<Mat>& frames, const vector<Mat>& homographies, Size canvasSize, const std::string& dir);
+Mat translation(double dx, double dy);
+Mat pooledMat(Size size, int type);
+void seedPairRNG(int i, int j);
+long peakRSSKB();
+long pageFaults();
+double cpuTimeMs();
+void writeTrace();
+int runJob(const vector<std::string>& imgNames, const std::string& alg_name, Ptr<GenericDescriptorMatcher> descriptorMatcher, int64 runStart);
+int runBatch(const std::string& manifest, int jobs, const std::string& alg_name, Ptr<GenericDescriptorMatcher> descriptorMatcher);
+std::string outputPath(const std::string& name);
+int runVideo(const std::string& source);
+void writeImage(const std::string& name, const Mat& image, int level);
+void flushWrites();
+double peakSignalToNoise(const Mat& a, const Mat& b);
+double structuralSimilarity(const Mat& a, const Mat& b);
+FeatureSet& getFeatures(const vector<Mat>& imgs, int index, double threshold, int level = 0, bool withDescriptors = false);
+const Mat& pyramidImage(const vector<Mat>& imgs, int index, int level);
+void trainModel(const vector<Mat>& imgs, int index, double threshold, int level, Ptr<GenericDescriptorMatcher> descriptorMatcher);
+std::string modelPath(int index, double threshold, int level);
+std::string temporaryPath(const std::string& path);
+void invalidateFeatures(int index);
+void loadImages(const vector<std::string>& paths, vector<Mat>& imgs, vector<Mat>& imgs_rgb);
+const Mat& colorImage(vector<Mat>& imgs_rgb, int index);
+void enforceMemoryBudget(vector<Mat>& imgs_rgb);
+double estimateFocal(const vector<Mat>& imgs);
+bool focalFromHomography(const Mat& H, Size size1, Size size2, double& focal);
+void projectInputs(vector<Mat>& imgs, vector<Mat>& imgs_rgb);
+Mat projectImage(const Mat& image);
+unsigned long long fileHash(const std::string& path);
+bool loadStoredFeatures(int index, double threshold, int level, bool withDescriptors, FeatureSet& features);
+void storeFeatures(int index, double threshold, int level, const FeatureSet& features);
+bool loadPairResult(int index1, int index2, int kind, float& score, Mat& H, vector<Point2f>& points1, vector<Point2f>& points2, vector<uchar>& inlierMask);
+void storePairResult(int index1, int index2, int kind, float score, const Mat& H, const vector<Point2f>& points1, const vector<Point2f>& points2, const vector<uchar>& inlierMask);
+//Pair scores for findBestMatch: -1 means recalculate, -2 means an image of the pair was deleted,
+//-3 means the pair's homography was rejected, so it isn't tried again until one of its images changes,
+//and -4 means the --retrieval pre-filter left the pair out of full matching
 Mat avgMatchDistances;
+
+//Thresholds used by the two phases, see the comments in findBestMatch and stitchImages before tweaking
+const double MATCH_SURF_THRESHOLD = 20.0e3;
+const double STITCH_SURF_THRESHOLD = 5.0e3;
+
+//Higher values seems to accept worse transformations
+//For demo:
+//horizontalAndVertical: 50
+//blurring: 90
+//horizontal: 90
+const double RANSAC_THRESHOLD = 90;
+
+//Robust estimation: a match is only kept if its nearest neighbour is clearly closer than the second nearest (Lowe ratio)
+//RANSAC stops once it is ROBUST_CONFIDENCE sure it has drawn an all-inlier sample, or after ROBUST_MAX_ITERATIONS,
+//and scores ROBUST_BATCH hypotheses at a time in parallel
+const double MATCH_RATIO = 0.8;
+const double ROBUST_CONFIDENCE = 0.995;
+const int ROBUST_MAX_ITERATIONS = 2000;
+const int ROBUST_BATCH = 64;
+
+//Retrieval pre-filter: visual words in the vocabulary, and how many ranking descriptors of each image k-means sees
+const int RETRIEVAL_WORDS = 256;
+const int RETRIEVAL_SAMPLES_PER_IMAGE = 300;
+
+//Guided matching: how far (full resolution pixels) from where the coarse homography predicts it a match may be
+const float GUIDED_RADIUS = 16;
+
+//Pairs with fewer RANSAC inliers than this are left out of the match graph in global mode
+const int MIN_GLOBAL_INLIERS = 20;
+
+//A homography is only used if it has this many RANSAC inliers and this share of the matches as inliers, keeps
+//orientation, stretches one direction at most MAX_HOMOGRAPHY_CONDITION times more than the other, maps the image
+//to a convex quadrilateral in front of the camera, and scales its area by at most MAX_AREA_RATIO either way
+const int MIN_HOMOGRAPHY_INLIERS = 10;
+const double MIN_INLIER_RATIO = 0.1;
+const double MAX_HOMOGRAPHY_CONDITION = 4;
+const double MAX_AREA_RATIO = 4;
+
+//Binary pipeline (algorithm BRIEF): how many FAST corners to keep for ranking and for stitching, and the Lowe ratio
+//a Hamming match has to pass. The grid spreads the corners over the image like in samples/video_homography.cpp
+const int BINARY_MATCH_FEATURES = 500;
+const int BINARY_STITCH_FEATURES = 1500;
+const int BINARY_GRID_SIZE = 4;
+const int FAST_THRESHOLD = 10;
+const int BRIEF_BYTES = 32;
+const double HAMMING_RATIO = 0.8;
+
+//Coarse-to-fine refinement: how many coarse inliers get relocated at full resolution, the half size of the patch
+//used to relocate them, and the normalised correlation a relocated point needs to be kept
+const int REFINE_POINTS = 200;
+const int REFINE_PATCH_RADIUS = 10;
+const double REFINE_MIN_SCORE = 0.8;
+const double REFINE_RANSAC_THRESHOLD = 3;
+
+//featureCache[i] maps a threshold and pyramid level to the features of imgs[i], so each image is only extracted once per key
+vector<std::map<FeatureKey, FeatureSet> > featureCache;
+//pyramidCache[i][l] is imgs[i] halved l times, built on demand
+vector<vector<Mat> > pyramidCache;
+int featureCacheHits = 0;
+int featureCacheMisses = 0;
+
+//Use FAST corners, BRIEF descriptors and our own Hamming matcher instead of SURF and a GenericDescriptorMatcher
+bool binaryPipeline = false;
 
+//Save trained matcher models in the feature store (or with the outputs) and load them on later runs, FERN only
+bool modelCacheOnDisk = false;
+//Algorithm name from the command line, part of the saved model and store keys
+std::string matcherName;
+int modelsTrained = 0;
+int modelsLoaded = 0;
+
+//Directory of the persistent feature store, empty if there is none. Features and pair results of input frames are
+//saved there under a hash of the frame's file content and of every parameter that changes them, so later runs with
+//the same frames only compute what is missing. See loadStoredFeatures for the file layout
+std::string featureStore;
+//imageHashes[i] is the FNV-1a hash of the file imgs[i] was decoded from, 0 without a store or model cache
+vector<unsigned long long> imageHashes;
+//The matcher's parameter file, and the hash of its content that goes into every store key, so editing the file
+//doesn't bring back results computed with the old parameters. Both stay empty for the binary pipeline
+std::string matcherParamsPath;
+unsigned long long matcherParamsHash = 0;
+int storedFeaturesLoaded = 0;
+int storedFeaturesSaved = 0;
+int storedPairsLoaded = 0;
+int storedPairsSaved = 0;
+const int FEATURE_STORE_VERSION = 1;
+
+//What a pair record in the feature store holds: the findBestMatch ranking score, or estimateHomography's result
+enum PairResultKind {
+    PAIR_SCORE,
+    PAIR_HOMOGRAPHY
+};
+
+//Where and how to write the per-stage trace, nothing is recorded without --trace
+std::string tracePath;
+int traceFormat = TRACE_JSON;
+vector<StageRecord> traceRecords;
+int64 traceStartTicks = 0;
+//Main loop iteration the current stages belong to
+int currentStitch = -1;
+
+//Run summary for benchmark.sh: a key=value file, and an image to score the final result against
+std::string summaryPath;
+std::string referencePath;
+//RANSAC inliers behind the homographies that were actually used to build the mosaic
+int stitchInliers = 0;
+
+//Warp cost so far, used to estimate what each rejected homography would have cost to warp
+double warpedMP = 0;
+double warpMs = 0;
+int rejectedHomographies = 0;
+double rejectedMP = 0;
+double blendedMP = 0;
+double blendMs = 0;
+
+//Multi-band blending: pyramid levels below full resolution, and the gain compensation model from Brown and Lowe,
+//"Automatic Panoramic Image Stitching using Invariant Features". Gains come from intensities sampled every
+//GAIN_SAMPLE_STEP pixels of the overlap, and are left at 1 with fewer than GAIN_MIN_SAMPLES overlapping samples
+const int BLEND_LEVELS = 4;
+const int GAIN_SAMPLE_STEP = 8;
+const int GAIN_MIN_SAMPLES = 100;
+const double GAIN_SIGMA_N = 10;
+const double GAIN_SIGMA_G = 0.1;
+
+//Debug images are only written at or above their level: 1 for the inputs of every stitch, the intermediate mosaics
+//and the uncropped result, 2 for the correspondences as well. At 0 only the final result.jpg is written
+int verbosity = 0;
+//Most debug images waiting for the writer thread at once, writeImage blocks beyond this to bound their memory
+const int MAX_PENDING_WRITES = 4;
+//While a batch waits for manifest lines on stdin, finished jobs are reaped this often, which bounds how late their
+//latency is measured
+const int BATCH_POLL_MS = 20;
+
+//Live panorama (--video): features per frame, how far a match may land from where the last homography predicts it,
+//the inliers a frame needs to count as tracked, how far (as a share of the frame's smaller side) the view may drift
+//from the last keyframe before the frame becomes a keyframe, and the largest mosaic it may grow to
+const int VIDEO_FEATURES = 500;
+const float VIDEO_SEARCH_WINDOW = 40;
+const int VIDEO_MIN_INLIERS = 15;
+const double VIDEO_KEYFRAME_SHIFT = 0.3;
+const double VIDEO_MAX_CANVAS_MP = 64;
+
+//Prepended to every file a run writes, so batch jobs sharing a directory don't overwrite each other
+std::string outputPrefix;
+//Where --model-cache saves models without a feature store, empty for under outputPrefix. A batch sets it to one
+//directory for all its jobs, so they share their models
+std::string modelDirectory;
+
+//Number of worker threads for feature extraction and pair scoring, 0 means one per core
+int numThreads = 0;
+
+//Match the dense stitching features only near where a coarse homography (from the pyramid, or from the sparse
+//ranking features) predicts them, instead of against every keypoint of the other image
+bool guidedMatching = false;
+
+//Rank pairs by the RANSAC inliers of their homography instead of by average descriptor distance
+bool rankByInliers = false;
+
+//If non-zero, findBestMatch only fully matches a pair if one of its images is among the other's retrievalNeighbours
+//most similar by bag of visual words. retrievalCheck matches the pruned pairs anyway to measure the recall
+int retrievalNeighbours = 0;
+bool retrievalCheck = false;
+//Set while findBestMatch retries the pruned pairs because none of the kept ones could be stitched
+bool retrievalExhaustive = false;
+//Word centres (CV_32F, one per row), and each image's word counts, kept until the image changes
+Mat retrievalVocabulary;
+vector<Mat> retrievalHistograms;
+//Pairs fully matched by findBestMatch, pairs the pre-filter saved from it, and how many images kept their best
+//exhaustive match out of those checked
+int matcherCalls = 0;
+int prunedPairs = 0;
+int recallHits = 0;
+int recallQueries = 0;
+
+//Match all original images once and warp them along a spanning tree instead of stitching greedily
+bool globalAlignment = false;
+
+//Rank pairs and estimate homographies on images halved this many times, then refine at full resolution. 0 is single scale
+int pyramidLevels = 0;
+
+//Bytes of colour image data allowed to stay resident, 0 means no limit
+//Colour data of input frames beyond the budget is dropped and decoded again from imagePaths when it is next needed
+size_t memoryBudget = 0;
+
+//Canvases and per stitch intermediates come from bufferPool (see pooledMat) instead of a fresh allocation each time,
+//so their pages stay mapped between iterations. Up to POOL_MAX_IDLE_MB of blocks nobody is using are kept around
+const size_t POOL_MAX_IDLE_MB = 512;
+vector<Mat> bufferPool;
+int poolHits = 0;
+int poolMisses = 0;
+double poolAllocMs = 0;
+size_t poolHighWater = 0;
+
+//imagePaths[i] is the file imgs_rgb[i] can be decoded from again, empty once the slot holds a stitched mosaic
+vector<std::string> imagePaths;
+
+//Applied to the final mosaic only, the intermediate mosaics are already tight (see stitchImages)
+int cropMode = CROP_NONE;
+
+int blendMode = BLEND_NONE;
+
+//Projection makes long pans fit, but doesn't exempt frames from validateHomography or the explosion checks, so a
+//badly matched frame is still dropped from a projected mosaic
+int projectionMode = PROJECTION_PLANE;
+//Focal length in pixels for the projection, 0 means estimate it from the homographies between the input frames
+double focalLength = 0;
+//Most neighbouring pairs estimateFocal finds a homography for, the median of a few estimates is already stable
+const int FOCAL_PAIRS = 8;
+//Set once the input frames have been projected, so frames decoded again get projected too
+bool inputsProjected = false;
+
+//Output tiles are tileSize x tileSize, warps only ever touch one tile of the destination at a time
+int tileSize = 512;
+//A tile's shifted homography changes warpPerspective's fixed point rounding, so --bench-warp allows warpTiled a small
+//mean difference from the full warp, and only this share of pixels off by more than WARP_CHECK_OUTLIER_LEVELS
+const double WARP_CHECK_MAX_MEAN_DIFF = 0.5;
+const int WARP_CHECK_OUTLIER_LEVELS = 2;
+const double WARP_CHECK_MAX_OUTLIERS = 0.001;
+
+//If set, --global streams finished tiles of the mosaic into this directory instead of building it in memory
+std::string tileDir;
+
 void help() {
     printf("Use the SURF descriptor to match keypoints between 2 images, show the correspondences, and show the stitched images\n");
-    printf("Format: \n./panograph <algorithm> <XML params> <image1> <image2> ...\n");
+    printf("Format: \n./panograph [options] <algorithm> <XML params> <image1> <image2> ...\n");
+    printf("        ./panograph [options] BRIEF [XML params] <image1> <image2> ...\n");
     printf("For example: ./panograph FERN samples/fern_params.xml testimages/horizontal/IMG_1457.jpg testimages/horizontal/IMG_1456.jpg \n");
+    printf("Algorithm BRIEF uses FAST corners, BRIEF descriptors and Hamming matching instead. It reads no XML params, so\n");
+    printf("they can be left out (a .xml or .yml file in their place is ignored)\n");
+    printf("Options:\n");
+    printf("  --threads N    Use N threads to extract features and score pairs (default: one per core)\n");
+    printf("  --global       Match the input images once and warp them all into one canvas along a spanning tree\n");
+    printf("  --guided       Match stitching features only near where a coarse homography predicts them\n");
+    printf("  --rank MODE    Pick the next pair by average match distance (default) or by homography inliers\n");
+    printf("  --retrieval K  Only match pairs where one image is among the other's K most similar by bag of visual words\n");
+    printf("  --retrieval-check  With --retrieval, match the pruned pairs too and report how often the best match was kept\n");
+    printf("  --pyramid L    Rank pairs and find homographies on images halved L times, then refine at full resolution\n");
+    printf("  --model-cache  Save each trained FERN model in the feature store (or with the outputs) and reuse it\n");
+    printf("  --feature-store DIR  Keep keypoints, descriptors, pair scores and homographies of the input frames in DIR,\n");
+    printf("                 keyed by file content and parameters, and only compute what DIR doesn't have yet\n");
+    printf("  --mem-budget MB  Keep at most MB of input colour data in memory, decoding frames again when needed\n");
+    printf("  --crop MODE    Crop the final mosaic: none (default), bounding or inscribed\n");
+    printf("  --blend MODE   Composite each warped image with none (default, it overwrites the mosaic) or multiband\n");
+    printf("                 (gain compensation and a Laplacian pyramid blend across the seam)\n");
+    printf("  --projection MODE  Project the frames onto a plane (default), cylindrical or spherical surface before stitching.\n");
+    printf("                 A frame whose homography fails validation or would explode is still left out of the mosaic\n");
+    printf("  --focal F      Focal length in pixels for --projection (default: estimated from the homographies)\n");
+    printf("  --tile-size N  Warp and composite in N x N tiles (default 512)\n");
+    printf("  --tile-dir DIR With --global, write the mosaic as tiles into DIR instead of result.jpg. This is the only\n");
+    printf("                 mode that never holds the whole mosaic, but it keeps every warped frame in memory\n");
+    printf("  --trace FILE   Write wall/CPU time, peak RSS and counters for every stage to FILE\n");
+    printf("  --trace-format json (default), csv or chrome (for chrome://tracing)\n");
+    printf("  --reference IMG  Report PSNR and SSIM of the final result against IMG\n");
+    printf("  --summary FILE Write time, throughput, peak RSS, mosaic size, inliers and quality as key=value lines to FILE\n");
+    printf("  --verbose N    Also write debug images: 1 adds the inputs of every stitch and the intermediate and uncropped\n");
+    printf("                 mosaics, 2 adds the correspondences (default 0, only result.jpg)\n");
+    printf("  --video SRC    Build a panorama live from a video file or a directory of frames (FAST/BRIEF, no other arguments)\n");
+    printf("  --batch FILE   Run one job per line of FILE (- for stdin): <output prefix> <image1> <image2> ...\n");
+    printf("                 Every output of a job, including its log and relative --trace and --summary paths, gets the\n");
+    printf("                 job's prefix. Without --feature-store, --model-cache models are shared in models/\n");
+    printf("  --jobs N       With --batch, run N jobs at once (default: one per core, each with cores / N threads)\n");
+    printf("  --bench-crop   Time cropBlack against the old per-pixel loop on canvases built from the given images\n");
+    printf("  --bench-warp   Time warpTiled against warpPerspective on the given images and check they agree\n");
 }
 
 int main(int argc, char** argv) {
-    if (argc < 5) {
+    int64 runStart = getTickCount();
+    traceStartTicks = runStart;
+
+    //Pull the options out first, everything else is positional
+    vector<std::string> args;
+    bool benchCrop = false;
+    bool benchWarp = false;
+    std::string batchPath;
+    int batchJobs = 0;
+    std::string videoSource;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            numThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--global") == 0) {
+            globalAlignment = true;
+        } else if (strcmp(argv[i], "--guided") == 0) {
+            guidedMatching = true;
+        } else if (strcmp(argv[i], "--rank") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "distance") == 0) {rankByInliers = false;}
+            else if (strcmp(argv[i], "inliers") == 0) {rankByInliers = true;}
+            else {printf("Unknown rank mode %s\n", argv[i]); help(); return 0;}
+        } else if (strcmp(argv[i], "--retrieval") == 0 && i + 1 < argc) {
+            retrievalNeighbours = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--retrieval-check") == 0) {
+            retrievalCheck = true;
+        } else if (strcmp(argv[i], "--pyramid") == 0 && i + 1 < argc) {
+            pyramidLevels = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--model-cache") == 0) {
+            modelCacheOnDisk = true;
+        } else if (strcmp(argv[i], "--feature-store") == 0 && i + 1 < argc) {
+            featureStore = std::string(argv[++i]);
+            mkdir(featureStore.c_str(), 0755);
+        } else if (strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc) {
+            memoryBudget = (size_t)atoi(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "none") == 0) {cropMode = CROP_NONE;}
+            else if (strcmp(argv[i], "bounding") == 0) {cropMode = CROP_BOUNDING;}
+            else if (strcmp(argv[i], "inscribed") == 0) {cropMode = CROP_INSCRIBED;}
+            else {printf("Unknown crop mode %s\n", argv[i]); help(); return 0;}
+        } else if (strcmp(argv[i], "--blend") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "none") == 0) {blendMode = BLEND_NONE;}
+            else if (strcmp(argv[i], "multiband") == 0) {blendMode = BLEND_MULTIBAND;}
+            else {printf("Unknown blend mode %s\n", argv[i]); help(); return 0;}
+        } else if (strcmp(argv[i], "--projection") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "plane") == 0) {projectionMode = PROJECTION_PLANE;}
+            else if (strcmp(argv[i], "cylindrical") == 0) {projectionMode = PROJECTION_CYLINDRICAL;}
+            else if (strcmp(argv[i], "spherical") == 0) {projectionMode = PROJECTION_SPHERICAL;}
+            else {printf("Unknown projection %s\n", argv[i]); help(); return 0;}
+        } else if (strcmp(argv[i], "--focal") == 0 && i + 1 < argc) {
+            focalLength = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+            tileSize = std::max(16, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--tile-dir") == 0 && i + 1 < argc) {
+            tileDir = std::string(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = std::string(argv[++i]);
+        } else if (strcmp(argv[i], "--trace-format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "json") == 0) {traceFormat = TRACE_JSON;}
+            else if (strcmp(argv[i], "csv") == 0) {traceFormat = TRACE_CSV;}
+            else if (strcmp(argv[i], "chrome") == 0) {traceFormat = TRACE_CHROME;}
+            else {printf("Unknown trace format %s\n", argv[i]); help(); return 0;}
+        } else if (strcmp(argv[i], "--reference") == 0 && i + 1 < argc) {
+            referencePath = std::string(argv[++i]);
+        } else if (strcmp(argv[i], "--summary") == 0 && i + 1 < argc) {
+            summaryPath = std::string(argv[++i]);
+        } else if (strcmp(argv[i], "--verbose") == 0 && i + 1 < argc) {
+            verbosity = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--video") == 0 && i + 1 < argc) {
+            videoSource = std::string(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchPath = std::string(argv[++i]);
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            batchJobs = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--bench-crop") == 0) {
+            benchCrop = true;
+        } else if (strcmp(argv[i], "--bench-warp") == 0) {
+            benchWarp = true;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("Unknown option %s\n", argv[i]);
+            help();
+            return 0;
+        } else {
+            args.push_back(std::string(argv[i]));
+        }
+    }
+
+    if (benchCrop && !args.empty()) {
+        benchmarkCrop(args);
+        return 0;
+    }
+    if (benchWarp && !args.empty()) {
+        return benchmarkWarp(args);
+    }
+
+    //The binary pipeline reads no matcher params, so unless something that looks like a params file follows BRIEF,
+    //an empty params argument stands in for it
+    if (!args.empty() && args[0] == "BRIEF") {
+        std::string extension = args.size() > 1 ? args[1].substr(args[1].find_last_of('.') + 1) : std::string();
+        if (extension != "xml" && extension != "yml" && extension != "yaml") {
+            args.insert(args.begin() + 1, std::string());
+        }
+    }
+
+    if (videoSource.empty() && args.size() < (batchPath.empty() ? 4 : 2)) {
         help();
         return 0;
     }
 
+#ifdef _OPENMP
+    if (!batchPath.empty()) {
+        //Thousands of small jobs scale better across processes than across threads, so split the cores between jobs
+        if (batchJobs == 0) {batchJobs = omp_get_num_procs();}
+        if (numThreads == 0) {numThreads = std::max(1, omp_get_num_procs() / batchJobs);}
+    }
+    if (numThreads > 0) {
+        omp_set_num_threads(numThreads);
+    }
+    printf("Using %d threads\n", omp_get_max_threads());
+#endif
+
+    if (!videoSource.empty()) {
+        return runVideo(videoSource);
+    }
+
     //For demo:
     //horizontalAndVertical: first 4 images, 1298 - 1301
     //blurring: 456, 457-2.9, 458
@@ -35,231 +631,3458 @@ int main(int argc, char** argv) {
     //everythingElse: 31
 
     //Get image names from args
-    std::string alg_name = std::string(argv[1]);
-    std::string params_filename = std::string(argv[2]);
-    std::string imgNames[argc - 3];
-    int imgCount = argc - 3;
-    for (int i = 3; i < argc; i++) {
-        imgNames[i - 3] = std::string(argv[i]);
-    }
-
-    //Set up descriptor matcher from args
-    Ptr<GenericDescriptorMatcher> descriptorMatcher = GenericDescriptorMatcher::create(alg_name, params_filename);
-    if (descriptorMatcher == 0) {
-        printf ("Could not create descriptor\n");
-        return 0;
+    std::string alg_name = args[0];
+    std::string params_filename = args[1];
+    matcherName = alg_name;
+    vector<std::string> imgNames(args.begin() + 2, args.end());
+
+    //Set up descriptor matcher from args, the binary pipeline doesn't need one
+    Ptr<GenericDescriptorMatcher> descriptorMatcher;
+    if (alg_name == "BRIEF") {
+        binaryPipeline = true;
+    } else if (alg_name == "FERN" && modelCacheOnDisk) {
+        //What GenericDescriptorMatcher::create does, with a matcher that can save its classifier
+        descriptorMatcher = new CachedFernMatcher();
+        if (!params_filename.empty()) {
+            FileStorage fs(params_filename, FileStorage::READ);
+            if (fs.isOpened()) {
+                descriptorMatcher->read(fs.root());
+            }
+        }
+    } else {
+        descriptorMatcher = GenericDescriptorMatcher::create(alg_name, params_filename);
+        if (descriptorMatcher == 0) {
+            printf ("Could not create descriptor\n");
+            return 0;
+        }
+        if (modelCacheOnDisk) {
+            printf("--model-cache only works with FERN, %s can't save its trained model\n", alg_name.c_str());
+            return 0;
+        }
+    }
+
+    if (!binaryPipeline) {
+        matcherParamsPath = params_filename;
     }
 
-    printf("Reading images...\n");
+    if (!batchPath.empty()) {
+        return runBatch(batchPath, std::max(1, batchJobs), alg_name, descriptorMatcher);
+    }
+    return runJob(imgNames, alg_name, descriptorMatcher, runStart);
+}
+
+//Stitches imgNames into result.jpg (under outputPrefix) with the options from the command line
+//Returns non-zero if the job could not run at all
+int runJob(const vector<std::string>& imgNames, const std::string& alg_name, Ptr<GenericDescriptorMatcher> descriptorMatcher, int64 runStart) {
+    int imgCount = imgNames.size();
+    avgMatchDistances = Mat(imgCount, imgCount, CV_32FC1, Scalar(-1));
+    featureCache.resize(imgCount);
+    pyramidCache.resize(imgCount);
+    retrievalHistograms.resize(imgCount);
+
     vector<Mat> imgs;
     vector<Mat> imgs_rgb;
+    {
+        ScopedStage stage("load");
+        loadImages(imgNames, imgs, imgs_rgb);
+        stage.set("images", imgCount);
+    }
+    double inputMP = 0;
     for (int i = 0; i < imgCount; i++) {
-        imgs.push_back(imread(imgNames[i].c_str(), 0));
-        imgs_rgb.push_back(imread(imgNames[i].c_str(), 1));
+        if (imgs[i].empty()) {
+            printf("Could not read %s\n", imgNames[i].c_str());
+            return 1;
+        }
+        inputMP += imgs[i].rows * imgs[i].cols / 1.0e6;
     }
 
-    avgMatchDistances = Mat(imgs.size(), imgs.size(), CV_32FC1, Scalar(-1));
+    if (projectionMode != PROJECTION_PLANE) {
+        if (focalLength <= 0) {
+            focalLength = estimateFocal(imgs);
+        }
+        projectInputs(imgs, imgs_rgb);
+    }
+
+    Mat mosaic;
+    if (globalAlignment) {
+        ScopedStage stage("global");
+        mosaic = stitchGlobal(imgs, imgs_rgb, descriptorMatcher);
+        //If it was streamed to tileDir there is nothing left to write or crop
+        imgCount = 1;
+    }
 
+    int stitchCount = 0;
     while (imgCount > 1) {
+        currentStitch = stitchCount++;
         printf("Finding best match...\n");
-        vector<int> bestMatches = findBestMatch(imgs, descriptorMatcher);
+        vector<int> bestMatches;
+        {
+            ScopedStage stage("find_best_match");
+            bestMatches = findBestMatch(imgs, descriptorMatcher);
+        }
+        if (bestMatches.empty()) {
+            printf("No usable homography between the remaining %d images\n", imgCount);
+            break;
+        }
 
+        ScopedStage stage("stitch");
+        stage.set("image1", bestMatches[0]);
+        stage.set("image2", bestMatches[1]);
         printf("Stitching images %d and %d\n", bestMatches[0], bestMatches[1]);
-        imwrite("stitching1.jpg", imgs_rgb[bestMatches[0]]);
-        imwrite("stitching2.jpg", imgs_rgb[bestMatches[1]]);
-        imgs_rgb[bestMatches[0]] = stitchImages(imgs[bestMatches[0]], imgs[bestMatches[1]], imgs_rgb[bestMatches[0]], imgs_rgb[bestMatches[1]], descriptorMatcher);
+        if (verbosity >= 1) {
+            writeImage("stitching1.jpg", colorImage(imgs_rgb, bestMatches[0]), 1);
+            writeImage("stitching2.jpg", colorImage(imgs_rgb, bestMatches[1]), 1);
+        }
+        Mat stitched = stitchImages(bestMatches[0], bestMatches[1], imgs, imgs_rgb, descriptorMatcher);
+        if (stitched.empty()) {
+            //Both images stay as they are, the next best pair gets its turn
+            avgMatchDistances.at<float>(bestMatches[0], bestMatches[1]) = -3;
+            continue;
+        }
+        markStitched(bestMatches[0], bestMatches[1]);
+        imgs_rgb[bestMatches[0]] = stitched;
+        //The mosaic only exists in memory, it can never be evicted
+        imagePaths[bestMatches[0]].clear();
 
-        Mat stitchedGray;
+        Mat stitchedGray = pooledMat(stitched.size(), CV_8UC1);
         cvtColor(imgs_rgb[bestMatches[0]], stitchedGray, CV_RGB2GRAY);
         imgs[bestMatches[0]] = stitchedGray;
 
         //Newly stitched image is stored in bestMatches[0], so we erase image at bestMatches[1]
         imgs[bestMatches[1]].release();
+        imgs_rgb[bestMatches[1]].release();
+        imagePaths[bestMatches[1]].clear();
+        enforceMemoryBudget(imgs_rgb);
 
-        imwrite("result.jpg", imgs_rgb[bestMatches[0]]);
+        //Only the stitched image has changed, every other image keeps its cached features
+        invalidateFeatures(bestMatches[0]);
+        invalidateFeatures(bestMatches[1]);
+
+        mosaic = imgs_rgb[bestMatches[0]];
+        writeImage("result.jpg", mosaic, 1);
         imgCount--;
     }
-}
+    currentStitch = -1;
 
-Mat stitchImages(Mat img1, Mat img2, Mat img1rgb, Mat img2rgb, Ptr<GenericDescriptorMatcher> descriptorMatcher) {
-    Size size1 = img1.size();
-    Size size2 = img2.size();
+    if (imgCount > 1) {
+        //Whatever could not be stitched, keep the largest piece as the result
+        int largest = -1;
+        for (int i = 0; i < imgs.size(); i++) {
+            if (imgs[i].empty()) {continue;}
+            if (largest < 0 || imgs[i].rows * imgs[i].cols > imgs[largest].rows * imgs[largest].cols) {largest = i;}
+        }
+        printf("Keeping image %d, the largest of the %d pieces left\n", largest, imgCount);
+        mosaic = colorImage(imgs_rgb, largest);
+    }
+    if (rejectedHomographies > 0) {
+        printf("Rejected %d homographies before warping, %.1f MP", rejectedHomographies, rejectedMP);
+        if (warpedMP > 0) {
+            printf(", saving about %.1f ms of warping at %.1f ms per MP", rejectedMP * warpMs / warpedMP, warpMs / warpedMP);
+        }
+        printf("\n");
+    }
+    //With --retrieval-check the pruned pairs were matched anyway, to check against
+    int filteredCalls = retrievalCheck ? matcherCalls - prunedPairs : matcherCalls;
+    int exhaustiveCalls = retrievalCheck ? matcherCalls : matcherCalls + prunedPairs;
+    if (retrievalNeighbours > 0) {
+        printf("Retrieval pre-filter: %d pairs pruned, %d matcher calls instead of %d\n", prunedPairs, filteredCalls, exhaustiveCalls);
+    }
+    double recall = recallQueries > 0 ? (double)recallHits / recallQueries : -1;
+    if (recallQueries > 0) {
+        printf("Retrieval recall: %d of %d images kept their best exhaustive match (%.1f%%)\n", recallHits, recallQueries, recall * 100);
+    }
+    double warpMsPerMP = warpedMP > 0 ? warpMs / warpedMP : 0;
+    double blendMsPerMP = blendedMP > 0 ? blendMs / blendedMP : 0;
+    if (blendedMP > 0 && warpMsPerMP > 0) {
+        printf("Blending took %.1f ms per MP, %.1f times the %.1f ms per MP of warping alone\n", blendMsPerMP, blendMsPerMP / warpMsPerMP, warpMsPerMP);
+    }
 
-    //Create a large image with image2 in the center so we can draw image1 in
-    printf("Setting up result image...\n");
-    Mat result(Size(size2.width * 3, size2.height * 3), img2rgb.type(), Scalar(0,0,0));
-    Rect img2ROI = Rect(size2.width, size2.height, size2.width, size2.height);
-    Mat centreOfResult = result(img2ROI);
-    img2rgb.copyTo(centreOfResult);
+    if (cropMode != CROP_NONE && !mosaic.empty()) {
+        ScopedStage stage("crop");
+        printf("Cropping image...\n");
+        Mat mosaicGray = pooledMat(mosaic.size(), CV_8UC1);
+        cvtColor(mosaic, mosaicGray, CV_RGB2GRAY);
+        writeImage("resultUncropped.jpg", mosaic, 1);
+        mosaic = cropBlack(mosaic, mosaicGray, cropMode);
+    }
 
-    printf("Result rows %d, result cols %d\n", result.rows, result.cols);
-    printf("Size width %d, size height %d\n", size2.width, size2.height);
+    //Intermediate result.jpg writes have to land before the final one
+    flushWrites();
+    if (!mosaic.empty()) {
+        ScopedStage stage("write_result");
+        imwrite(outputPath("result.jpg"), mosaic);
+    }
 
-    //Tweak this value, lower values detects more keypoints
-    //For demo:
-    //horizontalAndVertical: 5.0e3
-    //blurring: 4.0e3
-    //horizontal: 5.0e3 slow but nice
-    SURF surf_extractor(5.0e3);
-
-    printf("Extracting keypoints...\n");
-    vector<KeyPoint> keypoints1;
-    surf_extractor(img1, Mat(), keypoints1);
-    printf("Extracted %d keypoints from the first image\n", (int)keypoints1.size());
-
-    vector<KeyPoint> keypoints2;
-    surf_extractor(img2, Mat(), keypoints2);
-    printf("Extracted %d keypoints from the second image\n", (int)keypoints2.size());
+    //Score what ended up in result.jpg, resized to the reference if the geometry differs
+    double psnr = -1;
+    double ssim = -1;
+    if (!referencePath.empty() && !mosaic.empty()) {
+        Mat reference = imread(referencePath);
+        if (reference.empty()) {
+            printf("Could not read reference %s\n", referencePath.c_str());
+        } else {
+            Mat scored = mosaic;
+            if (scored.size() != reference.size()) {
+                printf("Result is %d x %d, resizing to the %d x %d reference\n", mosaic.cols, mosaic.rows, reference.cols, reference.rows);
+                resize(mosaic, scored, reference.size(), 0, 0, INTER_AREA);
+            }
+            Mat scoredGray, referenceGray;
+            cvtColor(scored, scoredGray, CV_RGB2GRAY);
+            cvtColor(reference, referenceGray, CV_RGB2GRAY);
+            psnr = peakSignalToNoise(scored, reference);
+            ssim = structuralSimilarity(scoredGray, referenceGray);
+            printf("Against %s: PSNR %.2f dB, SSIM %.4f\n", referencePath.c_str(), psnr, ssim);
+        }
+    }
 
-    printf("Finding nearest neighbors... \n");
-    vector<DMatch> matches1to2;
-    descriptorMatcher->match(img1, keypoints1, img2, keypoints2, matches1to2);
+    printf("Feature cache: %d hits, %d misses\n", featureCacheHits, featureCacheMisses);
+    printf("Buffer pool: %d hits, %d misses, %.1f ms allocating, %.1f MB in use at most\n", poolHits, poolMisses, poolAllocMs, poolHighWater / (1024.0 * 1024.0));
+    if (!featureStore.empty()) {
+        printf("Feature store %s: %d feature sets and %d pair results loaded, %d and %d saved\n", featureStore.c_str(),
+               storedFeaturesLoaded, storedPairsLoaded, storedFeaturesSaved, storedPairsSaved);
+    }
+    printf("Matcher models: %d trained, %d loaded from disk\n", modelsTrained, modelsLoaded);
+    double seconds = (getTickCount() - runStart) / getTickFrequency();
+    printf("Total time with %s: %.2f s\n", alg_name.c_str(), seconds);
+    writeTrace();
 
-    printf("Drawing correspondences... \n");
-    Mat img_corr;
-    drawMatches(img1rgb, keypoints1, img2rgb, keypoints2, matches1to2, img_corr);
-    imwrite("correspondences.jpg", img_corr);
+    if (!summaryPath.empty()) {
+        FILE* file = fopen(summaryPath.c_str(), "w");
+        if (file) {
+            fprintf(file, "algorithm=%s\n", alg_name.c_str());
+            fprintf(file, "images=%d\n", (int)imgNames.size());
+            fprintf(file, "input_mp=%.3f\n", inputMP);
+            fprintf(file, "seconds=%.3f\n", seconds);
+            fprintf(file, "mp_per_s=%.3f\n", seconds > 0 ? inputMP / seconds : 0);
+            fprintf(file, "peak_rss_kb=%ld\n", peakRSSKB());
+            fprintf(file, "page_faults=%ld\n", pageFaults());
+            fprintf(file, "pool_hits=%d\n", poolHits);
+            fprintf(file, "pool_misses=%d\n", poolMisses);
+            fprintf(file, "pool_alloc_ms=%.3f\n", poolAllocMs);
+            fprintf(file, "pool_high_water_kb=%ld\n", (long)(poolHighWater / 1024));
+            fprintf(file, "mosaic_width=%d\n", mosaic.cols);
+            fprintf(file, "mosaic_height=%d\n", mosaic.rows);
+            fprintf(file, "inliers=%d\n", stitchInliers);
+            fprintf(file, "rejected_homographies=%d\n", rejectedHomographies);
+            fprintf(file, "stored_features_loaded=%d\n", storedFeaturesLoaded);
+            fprintf(file, "stored_pairs_loaded=%d\n", storedPairsLoaded);
+            fprintf(file, "matcher_calls=%d\n", filteredCalls);
+            fprintf(file, "exhaustive_matcher_calls=%d\n", exhaustiveCalls);
+            fprintf(file, "pairs_pruned=%d\n", prunedPairs);
+            fprintf(file, "retrieval_recall=%.3f\n", recall);
+            fprintf(file, "warp_ms_per_mp=%.3f\n", warpMsPerMP);
+            fprintf(file, "blend_ms_per_mp=%.3f\n", blendMsPerMP);
+            fprintf(file, "psnr=%.3f\n", psnr);
+            fprintf(file, "ssim=%.4f\n", ssim);
+            fclose(file);
+        } else {
+            printf("Could not write summary to %s\n", summaryPath.c_str());
+        }
+    }
+    return 0;
+}
 
-    printf("Finding homography...\n");
-    vector<Point2f> points1, points2;
-    for(size_t q = 0; q < matches1to2.size(); q++)
-    {
-        const DMatch & dmatch = matches1to2[q];
+std::string outputPath(const std::string& name) {
+    return outputPrefix + name;
+}
 
-        points1.push_back(keypoints1[dmatch.queryIdx].pt);
+//Debug images waiting for the writer thread. Mats are reference counted, so queueing one doesn't copy its pixels
+struct PendingWrite {
+    std::string path;
+    Mat image;
+};
+std::deque<PendingWrite> writeQueue;
+pthread_mutex_t writeMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t writeQueued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t writeTaken = PTHREAD_COND_INITIALIZER;
+pthread_t writerThread;
+bool writerRunning = false;
+bool writerStopping = false;
+
+//Encodes and writes queued images until flushWrites() asks it to stop and the queue is empty
+static void* writerLoop(void*) {
+    pthread_mutex_lock(&writeMutex);
+    for (;;) {
+        while (writeQueue.empty() && !writerStopping) {
+            pthread_cond_wait(&writeQueued, &writeMutex);
+        }
+        if (writeQueue.empty()) {break;}
+        PendingWrite next = writeQueue.front();
+        writeQueue.pop_front();
+        pthread_cond_signal(&writeTaken);
+        pthread_mutex_unlock(&writeMutex);
+        imwrite(next.path, next.image);
+        pthread_mutex_lock(&writeMutex);
+    }
+    pthread_mutex_unlock(&writeMutex);
+    return 0;
+}
 
-        //Since we want to draw the transformed image1 onto the result image
-        //we translate the points so they are where image2 currently is
-        //This also helps avoid the clipping that occurs if image 1 is transformed
-        //while it is at (0,0)
-        Point2f translated = keypoints2[dmatch.trainIdx].pt;
-        translated.x = translated.x + size2.width;
-        translated.y = translated.y + size2.height;
-        points2.push_back(translated);
+//Queues image to be written to outputPath(name) in the background if verbosity is at least level
+//The caller must not modify image afterwards. The writer thread is started on first use, so a run at verbosity 0
+//never starts it and batch jobs each start their own after the fork
+void writeImage(const std::string& name, const Mat& image, int level) {
+    if (verbosity < level || image.empty()) {
+        return;
     }
-    //Higher values seems to accept worse transformations
-    //For demo:
-    //horizontalAndVertical: 50
-    //blurring: 90
-    //horizontal: 90
-    Mat H = findHomography(Mat(points1), Mat(points2), RANSAC, 90);
-
-    printf("Applying perspective warp...\n");
-    warpPerspective(img1rgb, result, H, result.size(), INTER_LINEAR, BORDER_TRANSPARENT);
-    Mat resultGray;
-    cvtColor(result, resultGray, CV_RGB2GRAY);
-
-    printf("Cropping image...\n");
-    imwrite("resultUncropped.jpg", result);
-    Mat croppedResult = cropBlack(result, resultGray);
-
-    //Attempt to detect when a correct transform could not be found and return the first input image
-    if ((croppedResult.rows > 0.98 * result.rows) && (croppedResult.cols > 0.98 * result.cols)) {
-        printf("Image explosion detected! Dropping stitched image and returning larger input image.\n");
-        if ((img1rgb.rows * img1rgb.cols) > (img2rgb.rows * img2rgb.cols)) {
-            return img1rgb;
+    PendingWrite write;
+    write.path = outputPath(name);
+    write.image = image;
+    pthread_mutex_lock(&writeMutex);
+    if (!writerRunning) {
+        writerStopping = false;
+        writerRunning = (pthread_create(&writerThread, 0, writerLoop, 0) == 0);
+    }
+    if (!writerRunning) {
+        //No thread to hand it to, write it ourselves
+        pthread_mutex_unlock(&writeMutex);
+        imwrite(write.path, write.image);
+        return;
+    }
+    while ((int)writeQueue.size() >= MAX_PENDING_WRITES) {
+        pthread_cond_wait(&writeTaken, &writeMutex);
+    }
+    writeQueue.push_back(write);
+    pthread_cond_signal(&writeQueued);
+    pthread_mutex_unlock(&writeMutex);
+}
+
+//Waits until every queued image has been written and stops the writer thread
+void flushWrites() {
+    pthread_mutex_lock(&writeMutex);
+    if (!writerRunning) {
+        pthread_mutex_unlock(&writeMutex);
+        return;
+    }
+    writerStopping = true;
+    pthread_cond_signal(&writeQueued);
+    pthread_mutex_unlock(&writeMutex);
+    pthread_join(writerThread, 0);
+    writerRunning = false;
+}
+
+//Frames of a video file, or the images in a directory in name order
+struct FrameSource {
+    VideoCapture capture;
+    vector<std::string> files;
+    int next;
+
+    bool open(const std::string& source) {
+        next = 0;
+        struct stat info;
+        if (stat(source.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+            DIR* dir = opendir(source.c_str());
+            if (!dir) {return false;}
+            for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+                std::string name = entry->d_name;
+                std::string extension = name.substr(name.find_last_of('.') + 1);
+                for (int k = 0; k < extension.size(); k++) {extension[k] = tolower(extension[k]);}
+                if (extension == "jpg" || extension == "jpeg" || extension == "png" || extension == "bmp" || extension == "tif" || extension == "tiff") {
+                    files.push_back(source + "/" + name);
+                }
+            }
+            closedir(dir);
+            std::sort(files.begin(), files.end());
+            return !files.empty();
+        }
+        return capture.open(source);
+    }
+
+    bool read(Mat& frame) {
+        if (files.empty()) {
+            capture >> frame;
         } else {
-            return img2rgb;
+            frame = (next < files.size()) ? imread(files[next++]) : Mat();
         }
-    } else {
-        return croppedResult;
-    }
-}
+        return !frame.empty();
+    }
+};
 
-//Crops toCrop to a rectangular image by looking at the first and last non-zero pixels
-Mat cropBlack(Mat toCrop, Mat toCropGray) {
-    int minCol = toCropGray.cols;
-    int minRow = toCropGray.rows;
-    int maxCol = 0;
-    int maxRow = 0;
-    for (int i = 0; i < toCropGray.rows - 3; i++) {
-        for (int j = 0; j < toCropGray.cols; j++) {
-            if (toCropGray.at<char>(i, j) != 0) {
-                if (i < minRow) {minRow = i;}
-                if (j < minCol) {minCol = j;}
-                if (i > maxRow) {maxRow = i;}
-                if (j > maxCol) {maxCol = j;}
+//Builds a panorama from a stream of frames in one pass, following samples/video_homography.cpp: FAST corners and
+//BRIEF descriptors per frame, matched against the last keyframe only where the previous homography predicts them.
+//A frame that has drifted far enough from the keyframe becomes the next keyframe and is warped into a mosaic that
+//grows as needed, up to VIDEO_MAX_CANVAS_MP. Only the last keyframe's features and the mosaic stay in memory, so the
+//cost of a frame doesn't depend on how many came before it
+int runVideo(const std::string& source) {
+    FrameSource frames;
+    if (!frames.open(source)) {
+        printf("Could not open %s\n", source.c_str());
+        return 1;
+    }
+
+    GridAdaptedFeatureDetector detector(new FastFeatureDetector(FAST_THRESHOLD, true), VIDEO_FEATURES, BINARY_GRID_SIZE, BINARY_GRID_SIZE);
+    BriefDescriptorExtractor brief(BRIEF_BYTES);
+
+    //Per-frame latency in power of two buckets of ms, the last one is open ended
+    const int BUCKETS = 12;
+    int histogram[BUCKETS] = {0};
+    double totalMs = 0;
+    double maxMs = 0;
+
+    vector<KeyPoint> keyKeypoints;
+    Mat keyDescriptors;
+    Mat keyToMosaic;  //last keyframe into mosaic coordinates, before the canvas offset
+    Mat H_prev;       //last keyframe into the current frame
+    Mat mosaic;
+    Rect canvas;      //area of mosaic coordinates the mosaic covers
+    bool canvasFull = false;
+    int frameCount = 0, keyframes = 0, lost = 0;
+
+    Mat frame;
+    while (frames.read(frame)) {
+        int64 frameStart = getTickCount();
+        ScopedStage stage("video_frame");
+        stage.set("frame", frameCount);
+        Mat gray;
+        cvtColor(frame, gray, CV_RGB2GRAY);
+        vector<KeyPoint> keypoints;
+        Mat descriptors;
+        detector.detect(gray, keypoints);
+        brief.compute(gray, keypoints, descriptors);
+        stage.set("keypoints", keypoints.size());
+
+        bool makeKeyframe = keyKeypoints.empty();
+        Mat frameToKey;
+        if (!makeKeyframe) {
+            //Look for each corner near where it was in the keyframe, according to the last homography
+            vector<DMatch> matches;
+            guidedMatch(keypoints, descriptors, keyKeypoints, keyDescriptors, H_prev.inv(), VIDEO_SEARCH_WINDOW, matches);
+
+            vector<Point2f> keyPoints, framePoints;
+            for (int q = 0; q < matches.size(); q++) {
+                keyPoints.push_back(keyKeypoints[matches[q].trainIdx].pt);
+                framePoints.push_back(keypoints[matches[q].queryIdx].pt);
+            }
+            vector<uchar> inlierMask;
+            Mat H = robustHomography(keyPoints, framePoints, 4, inlierMask);
+            int inliers = H.empty() ? 0 : countNonZero(Mat(inlierMask));
+            stage.set("matches", matches.size());
+            stage.set("inliers", inliers);
+
+            if (inliers < VIDEO_MIN_INLIERS || !validateHomography(H.inv(), inlierMask, frame.size())) {
+                //Lost track, keep waiting for a frame that matches the keyframe again
+                H_prev = Mat::eye(3, 3, CV_64FC1);
+                lost++;
+            } else {
+                H_prev = H;
+                frameToKey = H.inv();
+                vector<Point2f> centre(1, Point2f(frame.cols / 2.0f, frame.rows / 2.0f));
+                vector<Point2f> centreInKey(1);
+                Mat centreInKeyMat(centreInKey);
+                perspectiveTransform(Mat(centre), centreInKeyMat, frameToKey);
+                double shift = sqrt((centreInKey[0].x - centre[0].x) * (centreInKey[0].x - centre[0].x) + (centreInKey[0].y - centre[0].y) * (centreInKey[0].y - centre[0].y));
+                makeKeyframe = shift > VIDEO_KEYFRAME_SHIFT * std::min(frame.cols, frame.rows) || inliers < 2 * VIDEO_MIN_INLIERS;
+            }
+        }
+
+        if (makeKeyframe && !canvasFull) {
+            Mat frameToMosaic = keyToMosaic.empty() ? Mat::eye(3, 3, CV_64FC1) : Mat(keyToMosaic * frameToKey);
+            Rect frameBounds = projectedBounds(frame.size(), frameToMosaic);
+            Rect needed = mosaic.empty() ? frameBounds : (canvas | frameBounds);
+            if (mosaic.empty() || needed != canvas) {
+                //Grow by half a frame on every side that ran out, so the canvas isn't reallocated for every keyframe
+                Rect grown = needed;
+                if (!mosaic.empty()) {
+                    if (needed.x < canvas.x) {grown.x -= frame.cols / 2; grown.width += frame.cols / 2;}
+                    if (needed.y < canvas.y) {grown.y -= frame.rows / 2; grown.height += frame.rows / 2;}
+                    if (needed.br().x > canvas.br().x) {grown.width += frame.cols / 2;}
+                    if (needed.br().y > canvas.br().y) {grown.height += frame.rows / 2;}
+                }
+                if ((double)grown.area() > VIDEO_MAX_CANVAS_MP * 1.0e6) {
+                    printf("Mosaic would grow past %.0f MP, not adding any more keyframes\n", VIDEO_MAX_CANVAS_MP);
+                    canvasFull = true;
+                } else {
+                    Mat larger(grown.size(), frame.type(), Scalar(0, 0, 0));
+                    if (!mosaic.empty()) {
+                        Mat oldArea = larger(Rect(canvas.x - grown.x, canvas.y - grown.y, canvas.width, canvas.height));
+                        mosaic.copyTo(oldArea);
+                    }
+                    mosaic = larger;
+                    canvas = grown;
+                }
+            }
+            if (!canvasFull) {
+                warpTiled(frame, mosaic, translation(-canvas.x, -canvas.y) * frameToMosaic);
+                keyToMosaic = frameToMosaic;
+                keyKeypoints = keypoints;
+                keyDescriptors = descriptors.clone();
+                H_prev = Mat::eye(3, 3, CV_64FC1);
+                keyframes++;
+                stage.set("keyframe", 1);
+                printf("Frame %d is keyframe %d, mosaic is %d x %d\n", frameCount, keyframes, mosaic.cols, mosaic.rows);
+            }
+        }
+
+        double ms = (getTickCount() - frameStart) * 1000.0 / getTickFrequency();
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && ms >= (1 << bucket)) {bucket++;}
+        histogram[bucket]++;
+        totalMs += ms;
+        maxMs = std::max(maxMs, ms);
+        frameCount++;
+    }
+
+    printf("%d frames, %d keyframes, %d lost\n", frameCount, keyframes, lost);
+    if (frameCount > 0) {
+        printf("Per-frame latency (excluding decode): mean %.1f ms, max %.1f ms\n", totalMs / frameCount, maxMs);
+        for (int b = 0; b < BUCKETS; b++) {
+            if (b < BUCKETS - 1) {
+                printf("  %5d - %5d ms: %6d ", b == 0 ? 0 : 1 << (b - 1), 1 << b, histogram[b]);
+            } else {
+                printf("  %5d+        ms: %6d ", 1 << (b - 1), histogram[b]);
             }
+            for (int k = 0; k < 50 * histogram[b] / frameCount; k++) {printf("#");}
+            printf("\n");
+        }
+    }
+
+    if (!mosaic.empty()) {
+        if (cropMode != CROP_NONE) {
+            writeImage("resultUncropped.jpg", mosaic, 1);
+            Mat mosaicGray;
+            cvtColor(mosaic, mosaicGray, CV_RGB2GRAY);
+            mosaic = cropBlack(mosaic, mosaicGray, cropMode);
         }
+        flushWrites();
+        imwrite(outputPath("result.jpg"), mosaic);
     }
+    writeTrace();
+    return mosaic.empty() ? 1 : 0;
+}
 
-    printf("minRow: %d, minCol: %d, maxRow: %d, maxCol: %d\n", minRow, minCol, maxRow, maxCol);
+//A job of a batch that is still running
+struct BatchJob {
+    int line;
+    std::string prefix;
+    int64 start;
+};
 
-    Rect cropRect = Rect(minCol, minRow, maxCol - minCol, maxRow - minRow);
-    Mat cropped = toCrop(cropRect);
+//Reaps every running job that has finished, reports its latency and removes it from running. With block set it
+//first waits for one to finish. Returns how many of the reaped jobs failed
+static int reapJobs(std::map<pid_t, BatchJob>& running, bool block) {
+    int failed = 0;
+    for (;;) {
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+        if (pid == 0) {
+            break;
+        }
+        if (pid < 0) {
+            //No children left to wait for, whatever we thought was running is gone
+            failed += running.size();
+            running.clear();
+            break;
+        }
+        block = false;
+        std::map<pid_t, BatchJob>::iterator it = running.find(pid);
+        if (it == running.end()) {
+            continue;
+        }
+        double seconds = (getTickCount() - it->second.start) / getTickFrequency();
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        printf("Job %d (%s): %s in %.2f s\n", it->second.line, it->second.prefix.c_str(), ok ? "done" : "FAILED", seconds);
+        fflush(stdout);
+        running.erase(it);
+        if (!ok) {failed++;}
+    }
+    return failed;
+}
 
-    return cropped;
+//Blocks until fd has something to read (or is at end of file), reaping jobs every BATCH_POLL_MS meanwhile so a job
+//that finishes while the manifest is idle is reported then, not once the next line arrives
+static int waitForInput(int fd, std::map<pid_t, BatchJob>& running) {
+    int failed = 0;
+    for (;;) {
+        failed += reapJobs(running, false);
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(fd, &readable);
+        struct timeval timeout = {0, BATCH_POLL_MS * 1000};
+        //Nothing to reap, so there is no reason to wake up before input arrives. Errors are left to the read
+        if (select(fd + 1, &readable, 0, 0, running.empty() ? 0 : &timeout) != 0) {
+            return failed;
+        }
+    }
 }
 
-//Looks for the next images to stitch together by "quickly" testing all permutations
-vector<int> findBestMatch(vector<Mat> imgs, Ptr<GenericDescriptorMatcher> descriptorMatcher) {
-    //Use a high threshold so as to get fewer and stronger keypoints
-    //Tweak this value, lower values detects more keypoints
-    //If you get a failure on this step, it's probably because 0 matches were found, so reduce the threshold
-    //20.0e3 worked well for horizontal I think
-    //For demo:
-    //horizontalAndVertical: 9.0e3
-    //blurring: 14.0e3
-    //horizontal: 20.0e3
-    SURF surf_extractor(20.0e3);
+//Runs every job in the manifest, up to jobs at a time. Each line is an output prefix followed by the job's images;
+//empty lines and lines starting with # are skipped. A manifest of - reads jobs from stdin as they arrive, so another
+//process can keep feeding it. Each job runs in a forked child, which starts from a copy of this process: the matcher
+//is built once and shared copy-on-write, and every job gets fresh caches. No OpenMP region may run in this process
+//before the forks, a child can't use the thread pool of its parent
+int runBatch(const std::string& manifest, int jobs, const std::string& alg_name, Ptr<GenericDescriptorMatcher> descriptorMatcher) {
+    FILE* in = (manifest == "-") ? stdin : fopen(manifest.c_str(), "r");
+    if (!in) {
+        printf("Could not read manifest %s\n", manifest.c_str());
+        return 1;
+    }
 
-    vector<KeyPoint> keypoints[imgs.size()];
-    bool keypointsCalced[imgs.size()];
-    for (int i = 0; i < imgs.size(); i++) {
-        keypointsCalced[i] = false;
+    //select() only sees what the kernel holds, so stdio must not read ahead lines it would then sit on
+    if (in == stdin) {
+        setvbuf(in, 0, _IONBF, 0);
     }
 
-    for (int i = 0; i < imgs.size(); i++) {
-        for (int j = i + 1; j < imgs.size(); j++) {
-            if (avgMatchDistances.at<float>(i, j) == -1) {
-                printf("Must recalculate match between %d and %d\n", i, j);
-                if (!keypointsCalced[i]) {surf_extractor(imgs[i], Mat(), keypoints[i]); keypointsCalced[i] = true;}
-                if (!keypointsCalced[j]) {surf_extractor(imgs[j], Mat(), keypoints[j]); keypointsCalced[j] = true;}
+    if (modelCacheOnDisk && featureStore.empty()) {
+        modelDirectory = outputPath("models/");
+        mkdir(modelDirectory.c_str(), 0777);
+    }
+
+    int64 batchStart = getTickCount();
+    std::map<pid_t, BatchJob> running;
+    int started = 0;
+    int failed = 0;
+    int lineNumber = 0;
+    char* line = 0;
+    size_t lineCapacity = 0;
+    for (;;) {
+        //Jobs that finished since the last line are reaped now, so their latency doesn't include waiting for the next
+        failed += (in == stdin) ? waitForInput(fileno(in), running) : reapJobs(running, false);
+        if (getline(&line, &lineCapacity, in) == -1) {
+            break;
+        }
+        lineNumber++;
+        vector<std::string> fields;
+        for (char* field = strtok(line, " \t\r\n"); field; field = strtok(0, " \t\r\n")) {
+            fields.push_back(std::string(field));
+        }
+        if (fields.empty() || fields[0][0] == '#') {continue;}
+        if (fields.size() < 3) {
+            printf("Job %d: need an output prefix and at least 2 images, skipping\n", lineNumber);
+            failed++;
+            continue;
+        }
 
-                vector<DMatch> matches1to2;
-                descriptorMatcher->match(imgs[i], keypoints[i], imgs[j], keypoints[j], matches1to2);
+        while ((int)running.size() >= jobs) {
+            failed += reapJobs(running, true);
+        }
 
-                float sum = 0;
-                for (int k = 0; k < matches1to2.size(); k++) {sum += matches1to2[k].distance;}
-                avgMatchDistances.at<float>(i, j) = sum / matches1to2.size();
-                printf("Got %d matches and average match distance %f\n", matches1to2.size(), avgMatchDistances.at<float>(i, j));
+        BatchJob job;
+        job.line = lineNumber;
+        job.prefix = fields[0];
+        job.start = getTickCount();
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            printf("Job %d: fork failed\n", lineNumber);
+            failed++;
+            continue;
+        }
+        if (pid == 0) {
+            outputPrefix = job.prefix;
+            //A prefix ending in / is a directory of its own
+            if (outputPrefix[outputPrefix.size() - 1] == '/') {
+                mkdir(outputPrefix.c_str(), 0777);
+            }
+            if (!freopen(outputPath("log.txt").c_str(), "w", stdout)) {
+                _exit(1);
             }
+            //Absolute paths are left alone, the user picked them on purpose
+            if (!tracePath.empty() && tracePath[0] != '/') {tracePath = outputPath(tracePath);}
+            if (!summaryPath.empty() && summaryPath[0] != '/') {summaryPath = outputPath(summaryPath);}
+            if (!tileDir.empty() && tileDir[0] != '/') {tileDir = outputPath(tileDir);}
+            traceStartTicks = job.start;
+            vector<std::string> imgNames(fields.begin() + 1, fields.end());
+            int result = runJob(imgNames, alg_name, descriptorMatcher, job.start);
+            fflush(stdout);
+            _exit(result);
         }
+        running[pid] = job;
+        started++;
+    }
+    free(line);
+    if (in != stdin) {
+        fclose(in);
     }
 
-    float minDistance = 9001;
-    int minIndex1 = 0;
-    int minIndex2 = 0;
-    for (int i = 0; i < imgs.size(); i++) {
-        for (int j = i + 1; j < imgs.size(); j++) {
-            if (avgMatchDistances.at<float>(i, j) > 0) {
-                printf("Average match distance between %d and %d was %f\n", i, j, avgMatchDistances.at<float>(i, j));
-                if (avgMatchDistances.at<float>(i, j) < minDistance) {
-                    minDistance = avgMatchDistances.at<float>(i, j);
-                    minIndex1 = i;
-                    minIndex2 = j;
-                }
-            }
+    while (!running.empty()) {
+        failed += reapJobs(running, true);
+    }
+    double seconds = (getTickCount() - batchStart) / getTickFrequency();
+    printf("Batch: %d jobs started, %d failed, %.2f s total, %.2f jobs/s\n", started, failed, seconds, seconds > 0 ? started / seconds : 0);
+    return failed > 0 ? 1 : 0;
+}
+
+Mat stitchImages(int index1, int index2, vector<Mat>& imgs, vector<Mat>& imgs_rgb, Ptr<GenericDescriptorMatcher> descriptorMatcher) {
+    Mat img1rgb = colorImage(imgs_rgb, index1);
+    Mat img2rgb = colorImage(imgs_rgb, index2);
+    Size size1 = img1rgb.size();
+    Size size2 = img2rgb.size();
+
+    vector<Point2f> points1, points2;
+    vector<uchar> inlierMask;
+    //Otherwise the samples would come from whatever state the last pair findBestMatch ran on this thread left behind
+    seedPairRNG(index1, index2);
+    Mat H = estimateHomography(imgs, index1, index2, descriptorMatcher, points1, points2, inlierMask);
+    if (H.empty()) {
+        printf("Not enough matches for a homography!\n");
+        return Mat();
+    }
+    //Throw out bad homographies before any pixels move, instead of finding out from the warped result
+    if (!validateHomography(H, inlierMask, size1)) {
+        rejectedHomographies++;
+        rejectedMP += size1.area() / 1.0e6;
+        if (warpedMP > 0) {
+            printf("Skipped warping %.1f MP, about %.1f ms at the rate measured so far\n", size1.area() / 1.0e6, size1.area() / 1.0e6 * warpMs / warpedMP);
         }
+        return Mat();
     }
-    printf("Best match was between %d and %d: %f\n", minIndex1, minIndex2, minDistance);
 
-    //Now anything involving minIndex1 will need to be recalculated
-    for (int i = 0; i < imgs.size(); i++) {
-        if (avgMatchDistances.at<float>(i, minIndex1) != -2) {
-            avgMatchDistances.at<float>(i, minIndex1) = -1;
-            avgMatchDistances.at<float>(minIndex1, i) = -1;
+    if (verbosity >= 2) {
+        printf("Drawing correspondences... \n");
+        ScopedStage stage("draw_correspondences");
+        vector<KeyPoint> keypoints1, keypoints2;
+        vector<DMatch> matches1to2;
+        for (int q = 0; q < points1.size(); q++) {
+            keypoints1.push_back(KeyPoint(points1[q], 1));
+            keypoints2.push_back(KeyPoint(points2[q], 1));
+            matches1to2.push_back(DMatch(q, q, 0));
         }
+        //drawMatches puts the images side by side, sizing the output like this keeps it in the pool's buffer
+        Mat img_corr = pooledMat(Size(size1.width + size2.width, std::max(size1.height, size2.height)), CV_8UC3);
+        drawMatches(img1rgb, keypoints1, img2rgb, keypoints2, matches1to2, img_corr);
+        writeImage("correspondences.jpg", img_corr, 2);
     }
 
-    //And since minIndex2 will be deleted, we must indicate this using -2
-    for (int i = 0; i < imgs.size(); i++) {
-        avgMatchDistances.at<float>(i, minIndex2) = -2;
-        avgMatchDistances.at<float>(minIndex2, i) = -2;
+    //The result only needs to cover image2 plus wherever image1 lands. We still clip to the 3x window around
+    //image2 that the result used to be allocated as, so a bad homography can't ask for an enormous canvas
+    Rect img2Bounds = Rect(0, 0, size2.width, size2.height);
+    Rect window = Rect(-size2.width, -size2.height, size2.width * 3, size2.height * 3);
+    Rect bounds = (img2Bounds | projectedBounds(size1, H)) & window;
+
+    //validateHomography bounds the area, but a valid H can still push image1 far away from image2
+    if ((bounds.height > 0.98 * window.height) && (bounds.width > 0.98 * window.width)) {
+        printf("Image explosion detected!\n");
+        rejectedHomographies++;
+        rejectedMP += size1.area() / 1.0e6;
+        return Mat();
+    }
+
+    stitchInliers += countNonZero(Mat(inlierMask));
+
+    printf("Setting up result image...\n");
+    double canvasMB = (double)bounds.area() * img2rgb.elemSize() / (1024 * 1024);
+    double fixedCanvasMB = (double)window.area() * img2rgb.elemSize() / (1024 * 1024);
+    printf("Result %d x %d, %.1f MB (the fixed 3x canvas would have been %.1f MB)\n", bounds.width, bounds.height, canvasMB, fixedCanvasMB);
+    Mat result = pooledMat(bounds.size(), img2rgb.type());
+    result.setTo(Scalar(0,0,0));
+    Rect img2ROI = Rect(-bounds.x, -bounds.y, size2.width, size2.height);
+    Mat img2InResult = result(img2ROI);
+    img2rgb.copyTo(img2InResult);
+
+    //Shift the homography so image1 lands relative to where image2 sits in the result
+    //This also avoids the clipping that occurs if image 1 is transformed while it is at (0,0)
+    H = translation(-bounds.x, -bounds.y) * H;
+
+    if (blendMode == BLEND_MULTIBAND) {
+        printf("Blending...\n");
+        ScopedStage stage("blend");
+        stage.set("canvas_mb", canvasMB);
+        int64 blendStart = getTickCount();
+        blendInto(img1rgb, result, H, Point2f(img2ROI.x + size2.width / 2.0f, img2ROI.y + size2.height / 2.0f));
+        blendMs += (getTickCount() - blendStart) * 1000.0 / getTickFrequency();
+        blendedMP += size1.area() / 1.0e6;
+        warpedMP += size1.area() / 1.0e6;
+    } else {
+        printf("Applying perspective warp...\n");
+        ScopedStage stage("warp");
+        stage.set("canvas_mb", canvasMB);
+        int64 warpStart = getTickCount();
+        warpTiled(img1rgb, result, H);
+        warpMs += (getTickCount() - warpStart) * 1000.0 / getTickFrequency();
+        warpedMP += size1.area() / 1.0e6;
     }
+    printf("Peak RSS so far: %.1f MB\n", peakRSSKB() / 1024.0);
 
-    vector<int> minIndexes;
-    minIndexes.push_back(minIndex1);
-    minIndexes.push_back(minIndex2);
-    return minIndexes;
+    return result;
+}
+
+//Matches keypoints1 against keypoints2 and returns the homography taking img1 coordinates to img2 coordinates
+//points1/points2 are filled with the matched positions and inlierMask with the RANSAC inliers, one entry per match
+Mat findPairHomography(Mat img1, Mat img2, FeatureSet& features1, FeatureSet& features2, Ptr<GenericDescriptorMatcher> descriptorMatcher, vector<Point2f>& points1, vector<Point2f>& points2, vector<uchar>& inlierMask) {
+    printf("Finding nearest neighbors... \n");
+    vector<DMatch> matches1to2;
+    filterMatches(img1, features1, img2, features2, descriptorMatcher, matches1to2);
+    const vector<KeyPoint>& keypoints1 = features1.keypoints;
+    const vector<KeyPoint>& keypoints2 = features2.keypoints;
+
+    printf("Finding homography...\n");
+    points1.clear();
+    points2.clear();
+    for(size_t q = 0; q < matches1to2.size(); q++)
+    {
+        const DMatch & dmatch = matches1to2[q];
+        points1.push_back(keypoints1[dmatch.queryIdx].pt);
+        points2.push_back(keypoints2[dmatch.trainIdx].pt);
+    }
+    return robustHomography(points1, points2, RANSAC_THRESHOLD, inlierMask);
+}
+
+//Matches features1 against features2 like matchFeatures, but only keeps distinctive one-to-one matches, best first
+//distance becomes the ratio between the nearest and second nearest neighbour (the Hamming distance with BRIEF)
+void filterMatches(const Mat& img1, FeatureSet& features1, const Mat& img2, FeatureSet& features2, Ptr<GenericDescriptorMatcher> descriptorMatcher, vector<DMatch>& matches) {
+    matches.clear();
+    if (binaryPipeline) {
+        //hammingMatch already applies the ratio test and the cross check
+        hammingMatch(features1.descriptors, features2.descriptors, matches);
+        std::stable_sort(matches.begin(), matches.end());
+        return;
+    }
+
+    vector<vector<DMatch> > knnMatches;
+    if (!features2.model.empty()) {
+        features2.model->knnMatch(img1, features1.keypoints, knnMatches, 2);
+    } else {
+        descriptorMatcher->knnMatch(img1, features1.keypoints, img2, features2.keypoints, knnMatches, 2);
+    }
+
+    //Ratio test. Only meaningful when both distances are positive, matches without a usable second neighbour
+    //are kept but sorted behind every match that passed it
+    vector<DMatch> candidates;
+    for (int q = 0; q < knnMatches.size(); q++) {
+        if (knnMatches[q].empty()) {continue;}
+        DMatch best = knnMatches[q][0];
+        float ratio = MATCH_RATIO;
+        if (knnMatches[q].size() > 1 && best.distance >= 0 && knnMatches[q][1].distance > 0) {
+            ratio = best.distance / knnMatches[q][1].distance;
+            if (ratio >= MATCH_RATIO) {continue;}
+        }
+        best.distance = ratio;
+        candidates.push_back(best);
+    }
+
+    //Cross check: the model only searches from img1 into img2, so of all the queries that picked a train keypoint
+    //only the one that picked it most distinctively survives
+    std::map<int, int> bestForTrain;
+    for (int c = 0; c < candidates.size(); c++) {
+        std::map<int, int>::iterator it = bestForTrain.find(candidates[c].trainIdx);
+        if (it == bestForTrain.end()) {
+            bestForTrain[candidates[c].trainIdx] = c;
+        } else if (candidates[c].distance < candidates[it->second].distance) {
+            it->second = c;
+        }
+    }
+    for (std::map<int, int>::iterator it = bestForTrain.begin(); it != bestForTrain.end(); ++it) {
+        matches.push_back(candidates[it->second]);
+    }
+    std::stable_sort(matches.begin(), matches.end());
+    printf("Kept %d of %d matches after the ratio test and cross check\n", (int)matches.size(), (int)knnMatches.size());
+}
+
+//Counts the point pairs H maps within threshold pixels of each other, optionally marking them in inlierMask
+static int countInliers(const Mat& H, const vector<Point2f>& points1, const vector<Point2f>& points2, double threshold, vector<uchar>* inlierMask) {
+    const double* h = H.ptr<double>(0);
+    double thresholdSquared = threshold * threshold;
+    int count = 0;
+    for (int q = 0; q < points1.size(); q++) {
+        double x = points1[q].x;
+        double y = points1[q].y;
+        double w = h[6] * x + h[7] * y + h[8];
+        bool inlier = false;
+        if (fabs(w) > 1e-12) {
+            double dx = (h[0] * x + h[1] * y + h[2]) / w - points2[q].x;
+            double dy = (h[3] * x + h[4] * y + h[5]) / w - points2[q].y;
+            inlier = dx * dx + dy * dy <= thresholdSquared;
+        }
+        if (inlier) {count++;}
+        if (inlierMask) {(*inlierMask)[q] = inlier;}
+    }
+    return count;
+}
+
+//True if any three of the four points are (nearly) collinear, which makes the homography through them degenerate
+static bool degenerateSample(const Point2f* points) {
+    for (int a = 0; a < 4; a++) {
+        Point2f p = points[a];
+        Point2f u = points[(a + 1) % 4] - p;
+        Point2f v = points[(a + 2) % 4] - p;
+        if (fabs(u.x * v.y - u.y * v.x) < 1) {return true;}
+    }
+    return false;
+}
+
+//RANSAC for matches sorted best first, with PROSAC's guided sampling: early samples come from the few most distinctive
+//matches and the pool grows towards the full set on the schedule from Chum and Matas 2005, so a good model usually
+//turns up in the first batch. Hypotheses are drawn serially from theRNG(), so results don't depend on the thread
+//count, and scored in parallel a batch at a time. Sampling stops once the best inlier ratio makes ROBUST_CONFIDENCE
+//certain, and the winner is refitted by least squares to its inliers
+Mat robustHomography(const vector<Point2f>& points1, const vector<Point2f>& points2, double threshold, vector<uchar>& inlierMask) {
+    const int m = 4;
+    int N = points1.size();
+    inlierMask.assign(N, 0);
+    if (N < m) {
+        return Mat();
+    }
+    RNG& rng = theRNG();
+
+    //Tn is how many of the ROBUST_MAX_ITERATIONS samples uniform RANSAC would expect to draw only from the top n matches
+    double Tn = ROBUST_MAX_ITERATIONS;
+    for (int i = 0; i < m; i++) {Tn *= (double)(m - i) / (N - i);}
+    int TnPrime = 1;
+    int n = m;
+
+    Mat bestH;
+    int bestInliers = 0;
+    int iterations = 0;
+    int required = ROBUST_MAX_ITERATIONS;
+    while (iterations < required) {
+        vector<Mat> hypotheses;
+        while (hypotheses.size() < ROBUST_BATCH && iterations < required) {
+            iterations++;
+            if (iterations > TnPrime && n < N) {
+                double TnNext = Tn * (n + 1) / (n + 1 - m);
+                TnPrime += (int)ceil(TnNext - Tn);
+                Tn = TnNext;
+                n++;
+            }
+
+            //Until the schedule says otherwise, every sample includes the newest match in the pool
+            int sample[m];
+            int drawn = 0;
+            if (TnPrime >= iterations) {sample[drawn++] = n - 1;}
+            int pool = (drawn > 0) ? n - 1 : n;
+            while (drawn < m) {
+                int candidate = rng.uniform(0, pool);
+                bool duplicate = false;
+                for (int k = 0; k < drawn; k++) {duplicate = duplicate || sample[k] == candidate;}
+                if (!duplicate) {sample[drawn++] = candidate;}
+            }
+
+            Point2f src[m], dst[m];
+            for (int k = 0; k < m; k++) {
+                src[k] = points1[sample[k]];
+                dst[k] = points2[sample[k]];
+            }
+            if (degenerateSample(src) || degenerateSample(dst)) {continue;}
+            hypotheses.push_back(getPerspectiveTransform(src, dst));
+        }
+
+        vector<int> counts(hypotheses.size());
+        #pragma omp parallel for schedule(static)
+        for (int k = 0; k < (int)hypotheses.size(); k++) {
+            counts[k] = countInliers(hypotheses[k], points1, points2, threshold, 0);
+        }
+
+        for (int k = 0; k < hypotheses.size(); k++) {
+            if (counts[k] <= bestInliers) {continue;}
+            bestInliers = counts[k];
+            bestH = hypotheses[k];
+            //Samples needed to draw an all-inlier sample with ROBUST_CONFIDENCE at this inlier ratio
+            //Kept in double and clamped before the cast: a tiny ratio needs more samples than an int holds
+            double allInliers = pow((double)bestInliers / N, m);
+            if (allInliers >= 1) {
+                //Every match is an inlier, nothing left to find
+                required = iterations;
+            } else if (allInliers > 0) {
+                double needed = ceil(log(1 - ROBUST_CONFIDENCE) / log(1 - allInliers));
+                needed = std::max(0.0, std::min(needed, (double)ROBUST_MAX_ITERATIONS));
+                required = std::min(required, (int)needed);
+            }
+        }
+    }
+    if (bestH.empty() || bestInliers < m) {
+        return Mat();
+    }
+
+    //Least squares over the inliers, repeated while it gains inliers
+    countInliers(bestH, points1, points2, threshold, &inlierMask);
+    for (int round = 0; round < 2; round++) {
+        vector<Point2f> inliers1, inliers2;
+        for (int q = 0; q < N; q++) {
+            if (!inlierMask[q]) {continue;}
+            inliers1.push_back(points1[q]);
+            inliers2.push_back(points2[q]);
+        }
+        Mat refined = findHomography(Mat(inliers1), Mat(inliers2), 0);
+        if (refined.empty()) {break;}
+        vector<uchar> refinedMask(N);
+        int refinedInliers = countInliers(refined, points1, points2, threshold, &refinedMask);
+        if (refinedInliers < bestInliers) {break;}
+        bool gained = refinedInliers > bestInliers;
+        bestH = refined;
+        bestInliers = refinedInliers;
+        inlierMask.swap(refinedMask);
+        if (!gained) {break;}
+    }
+    printf("RANSAC: %d inliers of %d matches after %d samples\n", bestInliers, N, iterations);
+    return bestH;
+}
+
+//Homography taking imgs[index1] to imgs[index2] at full resolution, using STITCH_SURF_THRESHOLD features
+//With pyramidLevels > 0 the match runs on the downscaled images and the result is refined at full resolution
+//points1/points2/inlierMask are the full resolution correspondences behind the returned homography
+//Only reads the caches once the features have been extracted, so it can be called from several threads
+Mat estimateHomography(const vector<Mat>& imgs, int index1, int index2, Ptr<GenericDescriptorMatcher> descriptorMatcher, vector<Point2f>& points1, vector<Point2f>& points2, vector<uchar>& inlierMask) {
+    int64 start = getTickCount();
+    int level = pyramidLevels;
+    ScopedStage stage("estimate_homography");
+    stage.set("image1", index1);
+    stage.set("image2", index2);
+    float unusedScore;
+    Mat storedH;
+    if (loadPairResult(index1, index2, PAIR_HOMOGRAPHY, unusedScore, storedH, points1, points2, inlierMask)) {
+        printf("Loaded the homography from %d to %d from the feature store\n", index1, index2);
+        stage.set("stored", 1);
+        stage.set("matches", points1.size());
+        stage.set("inliers", countNonZero(Mat(inlierMask)));
+        return storedH;
+    }
+
+    //Keypoints come from the feature cache, extracted at STITCH_SURF_THRESHOLD
+    //Tweak that value, lower values detects more keypoints
+    //For demo:
+    //horizontalAndVertical: 5.0e3
+    //blurring: 4.0e3
+    //horizontal: 5.0e3 slow but nice
+    //match() swaps the train keypoints back into its argument, so work on copies
+    //With --guided and no pyramid the coarse homography comes from the sparse ranking features instead
+    double coarseThreshold = (guidedMatching && level == 0) ? MATCH_SURF_THRESHOLD : STITCH_SURF_THRESHOLD;
+    trainModel(imgs, index2, coarseThreshold, level, descriptorMatcher);
+    FeatureSet features1 = getFeatures(imgs, index1, coarseThreshold, level);
+    FeatureSet features2 = getFeatures(imgs, index2, coarseThreshold, level);
+    printf("Using %d and %d keypoints at pyramid level %d\n", (int)features1.keypoints.size(), (int)features2.keypoints.size(), level);
+    stage.set("keypoints1", features1.keypoints.size());
+    stage.set("keypoints2", features2.keypoints.size());
+
+    Mat H = findPairHomography(pyramidImage(imgs, index1, level), pyramidImage(imgs, index2, level), features1, features2, descriptorMatcher, points1, points2, inlierMask);
+    stage.set("matches", points1.size());
+    if (H.empty()) {
+        stage.set("inliers", 0);
+        storePairResult(index1, index2, PAIR_HOMOGRAPHY, 0, H, points1, points2, inlierMask);
+        return H;
+    }
+
+    double scale = 1 << level;
+    if (level > 0) {
+        //Bring the coarse estimate up to full resolution: H = S * H * S^-1 with S scaling by 2^level
+        Mat S = Mat::eye(3, 3, CV_64FC1);
+        S.at<double>(0, 0) = scale;
+        S.at<double>(1, 1) = scale;
+        H = S * H * S.inv();
+        for (int q = 0; q < points1.size(); q++) {
+            points1[q] = Point2f(points1[q].x * scale, points1[q].y * scale);
+            points2[q] = Point2f(points2[q].x * scale, points2[q].y * scale);
+        }
+        printf("Coarse reprojection error: %.2f px\n", reprojectionError(points1, points2, H, inlierMask));
+    }
+
+    if (guidedMatching || level > 0) {
+        vector<Point2f> finePoints1, finePoints2;
+        vector<uchar> fineInliers;
+        Mat fineH;
+        if (guidedMatching) {
+            fineH = guidedHomography(imgs, index1, index2, H, std::max(GUIDED_RADIUS, 2 * (float)scale), finePoints1, finePoints2, fineInliers);
+        }
+        if (fineH.empty() && level > 0) {
+            fineH = refineHomography(imgs[index1], imgs[index2], H, points1, inlierMask, 2 * (int)scale, finePoints1, finePoints2, fineInliers);
+        }
+        if (!fineH.empty()) {
+            H = fineH;
+            points1.swap(finePoints1);
+            points2.swap(finePoints2);
+            inlierMask.swap(fineInliers);
+        } else {
+            printf("Refinement failed, keeping the coarse homography\n");
+        }
+    }
+
+    int inliers = countNonZero(Mat(inlierMask));
+    double error = reprojectionError(points1, points2, H, inlierMask);
+    printf("Homography from %d of %d matches, reprojection error %.2f px, took %.1f ms\n", inliers, (int)inlierMask.size(),
+           error, (getTickCount() - start) * 1000.0 / getTickFrequency());
+    stage.set("inliers", inliers);
+    stage.set("inlier_ratio", inlierMask.empty() ? 0 : (double)inliers / inlierMask.size());
+    stage.set("reprojection_error", error);
+    storePairResult(index1, index2, PAIR_HOMOGRAPHY, 0, H, points1, points2, inlierMask);
+    return H;
+}
+
+//Relocates an even spread of the coarse inliers at full resolution. Each point's neighbourhood in img1 is warped into
+//img2's frame with the coarse H and then searched for by normalised correlation within searchRadius pixels of where
+//H predicts it. Returns the homography fitted to the relocated points, or an empty Mat if too few of them survive
+Mat refineHomography(const Mat& img1, const Mat& img2, const Mat& H, const vector<Point2f>& coarsePoints1, const vector<uchar>& coarseInliers, int searchRadius, vector<Point2f>& points1, vector<Point2f>& points2, vector<uchar>& inlierMask) {
+    vector<Point2f> candidates;
+    for (int q = 0; q < coarsePoints1.size(); q++) {
+        if (coarseInliers[q]) {candidates.push_back(coarsePoints1[q]);}
+    }
+    int step = std::max(1, (int)candidates.size() / REFINE_POINTS);
+
+    Mat Hinv = H.inv();
+    int r = REFINE_PATCH_RADIUS;
+    int patchSize = 2 * r + 1;
+    points1.clear();
+    points2.clear();
+    for (int q = 0; q < candidates.size(); q += step) {
+        //Predicted position in img2, rounded so the patch lines up with img2's pixel grid
+        vector<Point2f> predicted(1);
+        Mat predictedMat(predicted);
+        perspectiveTransform(Mat(vector<Point2f>(1, candidates[q])), predictedMat, H);
+        Point centre = Point(cvRound(predicted[0].x), cvRound(predicted[0].y));
+
+        Rect window = Rect(centre.x - r - searchRadius, centre.y - r - searchRadius, patchSize + 2 * searchRadius, patchSize + 2 * searchRadius);
+        if (window.x < 0 || window.y < 0 || window.x + window.width > img2.cols || window.y + window.height > img2.rows) {continue;}
+
+        //What img1 looks like around the point once warped into img2's frame
+        Mat patch;
+        warpPerspective(img1, patch, translation(r - centre.x, r - centre.y) * H, Size(patchSize, patchSize));
+
+        Mat scores;
+        matchTemplate(img2(window), patch, scores, CV_TM_CCOEFF_NORMED);
+        double bestScore;
+        Point best;
+        minMaxLoc(scores, 0, &bestScore, 0, &best);
+        if (bestScore < REFINE_MIN_SCORE) {continue;}
+
+        //The patch centre is exactly H^-1(centre) in img1, and it was found at best + r in the window
+        vector<Point2f> source(1);
+        Mat sourceMat(source);
+        perspectiveTransform(Mat(vector<Point2f>(1, Point2f(centre.x, centre.y))), sourceMat, Hinv);
+        points1.push_back(source[0]);
+        points2.push_back(Point2f(window.x + best.x + r, window.y + best.y + r));
+    }
+
+    printf("Relocated %d of %d coarse inliers at full resolution\n", (int)points1.size(), (int)candidates.size());
+    if (points1.size() < 8) {
+        return Mat();
+    }
+    return findHomography(Mat(points1), Mat(points2), RANSAC, REFINE_RANSAC_THRESHOLD, inlierMask);
+}
+
+//Mean distance between H(points1) and points2 over the inliers
+double reprojectionError(const vector<Point2f>& points1, const vector<Point2f>& points2, const Mat& H, const vector<uchar>& inlierMask) {
+    if (points1.empty()) {
+        return 0;
+    }
+    vector<Point2f> projected(points1.size());
+    Mat projectedMat(projected);
+    perspectiveTransform(Mat(points1), projectedMat, H);
+    double total = 0;
+    int count = 0;
+    for (int q = 0; q < points1.size(); q++) {
+        if (!inlierMask[q]) {continue;}
+        double dx = projected[q].x - points2[q].x;
+        double dy = projected[q].y - points2[q].y;
+        total += sqrt(dx * dx + dy * dy);
+        count++;
+    }
+    return count > 0 ? total / count : 0;
+}
+
+//Stitches all images in one pass:
+//  1. every pair of original images is matched once and weighted by its RANSAC inlier count
+//  2. the image with the most inliers overall becomes the reference
+//  3. a maximum spanning tree is grown from the reference (Prim) and homographies are chained along it
+//  4. every frame in the tree is warped into a canvas sized to fit them all
+//No feature extraction ever runs on a stitched mosaic, so cost is linear in the number of pairs
+Mat stitchGlobal(vector<Mat>& imgs, vector<Mat>& imgs_rgb, Ptr<GenericDescriptorMatcher> descriptorMatcher) {
+    int n = imgs.size();
+
+    //Before the models are trained, so the ranking features get their descriptors on extraction
+    Mat keep;
+    if (retrievalNeighbours > 0) {
+        ScopedStage stage("retrieval");
+        keep = retrievalCandidates(imgs);
+    }
+
+    //pairH[i * n + j] takes image i to image j, only filled for i < j
+    vector<Mat> pairH(n * n);
+    Mat inlierCounts(n, n, CV_32SC1, Scalar(0));
+    vector<Point> pairs;
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            if (keep.empty() || keep.at<uchar>(i, j) || retrievalCheck) {
+                pairs.push_back(Point(i, j));
+            }
+            if (!keep.empty() && !keep.at<uchar>(i, j)) {prunedPairs++;}
+        }
+    }
+
+    //Homographies the feature store already has are taken as they are, so only the images of the missing pairs are
+    //extracted, and models are only trained for the second image of each, the one estimateHomography matches against
+    vector<Mat> estimates(pairs.size());
+    vector<vector<Point2f> > pairPoints1(pairs.size()), pairPoints2(pairs.size());
+    vector<vector<uchar> > pairMasks(pairs.size());
+    vector<char> estimated(pairs.size(), 0);
+    if (!featureStore.empty()) {
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int p = 0; p < (int)pairs.size(); p++) {
+            float unusedScore;
+            estimated[p] = loadPairResult(pairs[p].x, pairs[p].y, PAIR_HOMOGRAPHY, unusedScore, estimates[p], pairPoints1[p], pairPoints2[p], pairMasks[p]);
+        }
+    }
+    vector<bool> imageNeeded(n, false);
+    vector<bool> trainNeeded(n, false);
+    for (int p = 0; p < (int)pairs.size(); p++) {
+        if (!estimated[p]) {
+            matcherCalls++;
+            imageNeeded[pairs[p].x] = true;
+            imageNeeded[pairs[p].y] = true;
+            trainNeeded[pairs[p].y] = true;
+        }
+    }
+    vector<int> pendingImages;
+    for (int i = 0; i < n; i++) {
+        if (imageNeeded[i]) {pendingImages.push_back(i);}
+    }
+
+    printf("Extracting keypoints from %d images...\n", (int)pendingImages.size());
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int k = 0; k < (int)pendingImages.size(); k++) {
+        int i = pendingImages[k];
+        getFeatures(imgs, i, STITCH_SURF_THRESHOLD, pyramidLevels);
+        //Guided matching without a pyramid matches coarsely against the MATCH_SURF_THRESHOLD model trained below,
+        //so the dense model would never be used (and it is the most expensive one to train)
+        bool coarseRanking = guidedMatching && pyramidLevels == 0;
+        if (trainNeeded[i] && !coarseRanking) {
+            trainModel(imgs, i, STITCH_SURF_THRESHOLD, pyramidLevels, descriptorMatcher);
+        }
+        //estimateHomography only reads the caches from its threads, so guided matching's features are made here
+        if (guidedMatching) {
+            getFeatures(imgs, i, STITCH_SURF_THRESHOLD, 0, true);
+            if (pyramidLevels == 0) {
+                getFeatures(imgs, i, MATCH_SURF_THRESHOLD, 0);
+                if (trainNeeded[i]) {
+                    trainModel(imgs, i, MATCH_SURF_THRESHOLD, 0, descriptorMatcher);
+                }
+            }
+        }
+    }
+
+    printf("Matching %d pairs...\n", (int)pairs.size());
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int p = 0; p < (int)pairs.size(); p++) {
+        int i = pairs[p].x;
+        int j = pairs[p].y;
+        vector<Point2f>& points1 = pairPoints1[p];
+        vector<uchar>& inlierMask = pairMasks[p];
+        if (estimated[p]) {
+            printf("Loaded the homography from %d to %d from the feature store\n", i, j);
+        } else {
+            seedPairRNG(i, j);
+            estimates[p] = estimateHomography(imgs, i, j, descriptorMatcher, points1, pairPoints2[p], inlierMask);
+        }
+        const Mat& H = estimates[p];
+        int inliers = H.empty() ? 0 : countNonZero(Mat(inlierMask));
+        printf("Pair %d-%d: %d matches, %d inliers\n", i, j, (int)points1.size(), inliers);
+        if (inliers >= MIN_GLOBAL_INLIERS && validateHomography(H, inlierMask, imgs[i].size())) {
+            pairH[i * n + j] = H;
+            inlierCounts.at<int>(i, j) = inliers;
+            inlierCounts.at<int>(j, i) = inliers;
+        }
+    }
+
+    //With --retrieval-check every pair was matched, so see whether each image's best connection survived the
+    //pre-filter, then drop the pruned pairs from the graph as if they had never been matched
+    if (!keep.empty() && retrievalCheck) {
+        for (int i = 0; i < n; i++) {
+            int best = -1;
+            for (int j = 0; j < n; j++) {
+                if (inlierCounts.at<int>(i, j) > 0 && (best < 0 || inlierCounts.at<int>(i, j) > inlierCounts.at<int>(i, best))) {best = j;}
+            }
+            if (best < 0) {continue;}
+            recallQueries++;
+            if (keep.at<uchar>(std::min(i, best), std::max(i, best))) {recallHits++;}
+        }
+        for (int i = 0; i < n; i++) {
+            for (int j = i + 1; j < n; j++) {
+                if (!keep.at<uchar>(i, j)) {
+                    pairH[i * n + j] = Mat();
+                    inlierCounts.at<int>(i, j) = 0;
+                    inlierCounts.at<int>(j, i) = 0;
+                }
+            }
+        }
+    }
+
+    //The reference is the best connected image, everything else is warped into its frame
+    int reference = 0;
+    int bestWeight = -1;
+    for (int i = 0; i < n; i++) {
+        int weight = 0;
+        for (int j = 0; j < n; j++) {weight += inlierCounts.at<int>(i, j);}
+        if (weight > bestWeight) {
+            bestWeight = weight;
+            reference = i;
+        }
+    }
+    printf("Using image %d as the reference\n", reference);
+
+    //Prim's algorithm on inlier counts, toReference[k] chains the tree edges from k back to the reference
+    vector<Mat> toReference(n);
+    vector<bool> inTree(n, false);
+    vector<int> order;
+    vector<int> edgeInliers(n, 0);
+    toReference[reference] = Mat::eye(3, 3, CV_64FC1);
+    inTree[reference] = true;
+    order.push_back(reference);
+    for (;;) {
+        int bestParent = -1;
+        int bestChild = -1;
+        int bestInliers = 0;
+        for (int a = 0; a < n; a++) {
+            if (!inTree[a]) {continue;}
+            for (int b = 0; b < n; b++) {
+                if (!inTree[b] && inlierCounts.at<int>(a, b) > bestInliers) {
+                    bestInliers = inlierCounts.at<int>(a, b);
+                    bestParent = a;
+                    bestChild = b;
+                }
+            }
+        }
+        if (bestChild == -1) {break;}
+
+        Mat childToParent;
+        if (bestChild < bestParent) {
+            childToParent = pairH[bestChild * n + bestParent];
+        } else {
+            childToParent = pairH[bestParent * n + bestChild].inv();
+        }
+        toReference[bestChild] = toReference[bestParent] * childToParent;
+        inTree[bestChild] = true;
+        order.push_back(bestChild);
+        edgeInliers[bestChild] = bestInliers;
+        printf("Attaching image %d to image %d (%d inliers)\n", bestChild, bestParent, bestInliers);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (!inTree[i]) {printf("Image %d did not match anything, leaving it out\n", i);}
+    }
+
+    //Size the canvas to fit every projected frame, dropping frames whose chained homography has exploded
+    //(the same 3x limit the greedy path gets from its fixed canvas)
+    Rect bounds = Rect(0, 0, imgs[reference].cols, imgs[reference].rows);
+    for (int k = order.size() - 1; k > 0; k--) {
+        Rect frameBounds = projectedBounds(imgs[order[k]].size(), toReference[order[k]]);
+        if (frameBounds.width > 3 * imgs[order[k]].cols || frameBounds.height > 3 * imgs[order[k]].rows) {
+            printf("Image explosion detected for image %d! Leaving it out.\n", order[k]);
+            order.erase(order.begin() + k);
+        } else {
+            bounds = bounds | frameBounds;
+        }
+    }
+    printf("Canvas is %d x %d\n", bounds.width, bounds.height);
+    for (int k = 1; k < order.size(); k++) {
+        stitchInliers += edgeInliers[order[k]];
+    }
+    Mat offset = translation(-bounds.x, -bounds.y);
+
+    //Warp the frames furthest from the reference first so the reference ends up on top
+    if (!tileDir.empty()) {
+        //Every tile can need any frame, so they all have to be resident here
+        vector<Mat> frames;
+        vector<Mat> homographies;
+        for (int k = order.size() - 1; k >= 0; k--) {
+            frames.push_back(colorImage(imgs_rgb, order[k]));
+            homographies.push_back(offset * toReference[order[k]]);
+        }
+        compositeTiles(frames, homographies, bounds.size(), tileDir);
+        return Mat();
+    }
+
+    Mat result = pooledMat(bounds.size(), colorImage(imgs_rgb, reference).type());
+    result.setTo(Scalar(0,0,0));
+    for (int k = order.size() - 1; k >= 0; k--) {
+        printf("Warping image %d...\n", order[k]);
+        warpTiled(colorImage(imgs_rgb, order[k]), result, offset * toReference[order[k]]);
+        enforceMemoryBudget(imgs_rgb);
+    }
+    return result;
+}
+
+//warpPerspective(src, dst, H, dst.size(), INTER_LINEAR, BORDER_TRANSPARENT), but done one output tile at a time.
+//Each tile only reads the part of src that maps into it, so tiles are independent and run in parallel. The shifted
+//homography rounds coordinates differently, so pixels can differ slightly from the full warp (--bench-warp checks it)
+void warpTiled(const Mat& src, Mat& dst, const Mat& H) {
+    Mat Hinv;
+    Mat(H.inv()).convertTo(Hinv, CV_64F);
+    int tileRows = (dst.rows + tileSize - 1) / tileSize;
+    int tileCols = (dst.cols + tileSize - 1) / tileSize;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int t = 0; t < tileRows * tileCols; t++) {
+        Rect tile = Rect((t % tileCols) * tileSize, (t / tileCols) * tileSize, tileSize, tileSize) & Rect(0, 0, dst.cols, dst.rows);
+        Rect region;
+        if (!sourceRegion(src.size(), Hinv, tile, region)) {continue;}
+
+        //Move H so it maps the source region onto the tile, both starting at (0,0)
+        Mat tileH = translation(-tile.x, -tile.y) * H * translation(region.x, region.y);
+        Mat dstTile = dst(tile);
+        warpPerspective(src(region), dstTile, tileH, tile.size(), INTER_LINEAR, BORDER_TRANSPARENT);
+    }
+}
+
+//Finds the part of a srcSize image that maps into tile, given the inverse homography (tile to source)
+//Returns false if none of the source lands in the tile
+bool sourceRegion(Size srcSize, const Mat& Hinv, Rect tile, Rect& region) {
+    const double* h = Hinv.ptr<double>(0);
+    double left = tile.x, right = tile.x + tile.width;
+    double top = tile.y, bottom = tile.y + tile.height;
+    double xs[4] = {left, right, right, left};
+    double ys[4] = {top, top, bottom, bottom};
+    double minX = 0, maxX = 0, minY = 0, maxY = 0;
+    for (int k = 0; k < 4; k++) {
+        double w = h[6] * xs[k] + h[7] * ys[k] + h[8];
+        if (w <= 1e-12) {
+            //The tile reaches past the horizon of the warp, fall back to the whole source
+            region = Rect(0, 0, srcSize.width, srcSize.height);
+            return true;
+        }
+        double x = (h[0] * xs[k] + h[1] * ys[k] + h[2]) / w;
+        double y = (h[3] * xs[k] + h[4] * ys[k] + h[5]) / w;
+        if (k == 0 || x < minX) {minX = x;}
+        if (k == 0 || x > maxX) {maxX = x;}
+        if (k == 0 || y < minY) {minY = y;}
+        if (k == 0 || y > maxY) {maxY = y;}
+    }
+    if (maxX < -2 || maxY < -2 || minX > srcSize.width + 2 || minY > srcSize.height + 2) {
+        return false;
+    }
+
+    //Pad by a couple of pixels so bilinear interpolation sees the same neighbours it would in the full image
+    int x = std::max(0, cvFloor(minX) - 2);
+    int y = std::max(0, cvFloor(minY) - 2);
+    int regionRight = std::min(srcSize.width, cvCeil(maxX) + 3);
+    int regionBottom = std::min(srcSize.height, cvCeil(maxY) + 3);
+    region = Rect(x, y, regionRight - x, regionBottom - y);
+    return region.width > 0 && region.height > 0;
+}
+
+//Gains for src and dst minimising Brown and Lowe's gain error over their overlap: the squared difference of the mean
+//overlap intensities, plus a prior that keeps both gains near 1. src is sampled through H at every GAIN_SAMPLE_STEP
+//pixels of area in dst, and only samples where both images have a non-black pixel count
+static void overlapGains(const Mat& src, const Mat& dst, const Mat& H, Rect area, double& gain1, double& gain2) {
+    gain1 = 1;
+    gain2 = 1;
+    Mat Hinv;
+    Mat(H.inv()).convertTo(Hinv, CV_64F);
+    const double* h = Hinv.ptr<double>(0);
+    double sum1 = 0, sum2 = 0;
+    int samples = 0;
+    for (int y = area.y; y < area.y + area.height; y += GAIN_SAMPLE_STEP) {
+        const uchar* row2 = dst.ptr(y);
+        for (int x = area.x; x < area.x + area.width; x += GAIN_SAMPLE_STEP) {
+            const uchar* pixel2 = row2 + 3 * x;
+            if ((pixel2[0] | pixel2[1] | pixel2[2]) == 0) {continue;}
+            double w = h[6] * x + h[7] * y + h[8];
+            if (w <= 1e-12) {continue;}
+            int sx = cvRound((h[0] * x + h[1] * y + h[2]) / w);
+            int sy = cvRound((h[3] * x + h[4] * y + h[5]) / w);
+            if (sx < 0 || sy < 0 || sx >= src.cols || sy >= src.rows) {continue;}
+            const uchar* pixel1 = src.ptr(sy) + 3 * sx;
+            if ((pixel1[0] | pixel1[1] | pixel1[2]) == 0) {continue;}
+            sum1 += (pixel1[0] + pixel1[1] + pixel1[2]) / 3.0;
+            sum2 += (pixel2[0] + pixel2[1] + pixel2[2]) / 3.0;
+            samples++;
+        }
+    }
+    if (samples < GAIN_MIN_SAMPLES) {return;}
+
+    //Setting the derivatives of the error to 0 gives a 2x2 linear system in the gains
+    double mean1 = sum1 / samples, mean2 = sum2 / samples;
+    double noise = 1 / (GAIN_SIGMA_N * GAIN_SIGMA_N);
+    double prior = 1 / (GAIN_SIGMA_G * GAIN_SIGMA_G);
+    double a11 = mean1 * mean1 * noise + prior;
+    double a12 = -mean1 * mean2 * noise;
+    double a22 = mean2 * mean2 * noise + prior;
+    double det = a11 * a22 - a12 * a12;
+    gain1 = prior * (a22 - a12) / det;
+    gain2 = prior * (a11 - a12) / det;
+}
+
+//Hard seam weights for one band: a pixel belongs to the warped image if only it covers the pixel, or if both do and
+//the pixel is closer to centre1 than centre2, which puts the seam on the perpendicular bisector of the two centres.
+//covered is 255 wherever either image has a pixel
+static void seamWeights(const Mat& warped, const Mat& mosaic, Point2f centre1, Point2f centre2, Mat& weights1, Mat& weights2, Mat& covered) {
+    weights1.create(warped.size(), CV_32F);
+    weights2.create(warped.size(), CV_32F);
+    covered.create(warped.size(), CV_8U);
+    //|p - c1|^2 < |p - c2|^2 is the same as 2 p.(c2 - c1) < |c2|^2 - |c1|^2
+    double ax = 2.0 * (centre2.x - centre1.x);
+    double ay = 2.0 * (centre2.y - centre1.y);
+    double c = (double)centre2.x * centre2.x + (double)centre2.y * centre2.y - (double)centre1.x * centre1.x - (double)centre1.y * centre1.y;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int y = 0; y < warped.rows; y++) {
+        const uchar* row1 = warped.ptr(y);
+        const uchar* row2 = mosaic.ptr(y);
+        float* w1 = weights1.ptr<float>(y);
+        float* w2 = weights2.ptr<float>(y);
+        uchar* cover = covered.ptr(y);
+        for (int x = 0; x < warped.cols; x++) {
+            bool in1 = (row1[3 * x] | row1[3 * x + 1] | row1[3 * x + 2]) != 0;
+            bool in2 = (row2[3 * x] | row2[3 * x + 1] | row2[3 * x + 2]) != 0;
+            bool first = in1 && (!in2 || ax * x + ay * y < c);
+            w1[x] = first ? 1.0f : 0.0f;
+            w2[x] = (in2 && !first) ? 1.0f : 0.0f;
+            cover[x] = (in1 || in2) ? 255 : 0;
+        }
+    }
+}
+
+//pyramid[k] = G(k) - pyrUp(G(k + 1)) for the Gaussian pyramid G of image, with the coarsest G as the last level
+static void laplacianPyramid(const Mat& image, vector<Mat>& pyramid) {
+    pyramid.resize(BLEND_LEVELS + 1);
+    Mat current = image;
+    for (int k = 0; k < BLEND_LEVELS; k++) {
+        Mat down, up;
+        pyrDown(current, down);
+        pyrUp(down, up, current.size());
+        subtract(current, up, pyramid[k]);
+        current = down;
+    }
+    pyramid[BLEND_LEVELS] = current;
+}
+
+//out[i] = (a[i] * wa[i] + b[i] * wb[i]) / (wa[i] + wb[i] + eps) for i in [0, n), 8 (AVX) or 4 (SSE) floats at a time
+//The epsilon keeps pixels neither image covers at 0 instead of dividing by 0
+static inline void blendWeighted(const float* a, const float* wa, const float* b, const float* wb, float* out, int n) {
+    const float eps = 1e-5f;
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256 eps8 = _mm256_set1_ps(eps);
+    for (; i + 8 <= n; i += 8) {
+        __m256 weightA = _mm256_loadu_ps(wa + i);
+        __m256 weightB = _mm256_loadu_ps(wb + i);
+        __m256 sum = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i), weightA), _mm256_mul_ps(_mm256_loadu_ps(b + i), weightB));
+        _mm256_storeu_ps(out + i, _mm256_div_ps(sum, _mm256_add_ps(_mm256_add_ps(weightA, weightB), eps8)));
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128 eps4 = _mm_set1_ps(eps);
+    for (; i + 4 <= n; i += 4) {
+        __m128 weightA = _mm_loadu_ps(wa + i);
+        __m128 weightB = _mm_loadu_ps(wb + i);
+        __m128 sum = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), weightA), _mm_mul_ps(_mm_loadu_ps(b + i), weightB));
+        _mm_storeu_ps(out + i, _mm_div_ps(sum, _mm_add_ps(_mm_add_ps(weightA, weightB), eps4)));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = (a[i] * wa[i] + b[i] * wb[i]) / (wa[i] + wb[i] + eps);
+    }
+}
+
+//Multi-band blend of one band: each Laplacian level of the two images is mixed with the seam weights blurred down
+//to that level, so low frequencies blend over a wide region and fine detail over a narrow one. warped is scaled by gain1
+static Mat blendBand(const Mat& warped, double gain1, const Mat& mosaic, const Mat& weights1, const Mat& weights2) {
+    //Every band is the same size, so after the first one these come straight back out of the pool
+    Mat image1 = pooledMat(warped.size(), CV_32FC3);
+    Mat image2 = pooledMat(mosaic.size(), CV_32FC3);
+    warped.convertTo(image1, CV_32F, gain1);
+    mosaic.convertTo(image2, CV_32F);
+    vector<Mat> laplacian1, laplacian2;
+    laplacianPyramid(image1, laplacian1);
+    laplacianPyramid(image2, laplacian2);
+
+    Mat levelWeights1 = weights1, levelWeights2 = weights2;
+    for (int k = 0; k <= BLEND_LEVELS; k++) {
+        if (k > 0) {
+            Mat down1, down2;
+            pyrDown(levelWeights1, down1, laplacian1[k].size());
+            pyrDown(levelWeights2, down2, laplacian2[k].size());
+            levelWeights1 = down1;
+            levelWeights2 = down2;
+        }
+        //One weight per channel, so the kernel can run over the interleaved pixels
+        Mat channelWeights1, channelWeights2;
+        cvtColor(levelWeights1, channelWeights1, CV_GRAY2RGB);
+        cvtColor(levelWeights2, channelWeights2, CV_GRAY2RGB);
+        Mat& level = laplacian1[k];
+        int n = level.cols * level.channels();
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int y = 0; y < level.rows; y++) {
+            blendWeighted(level.ptr<float>(y), channelWeights1.ptr<float>(y), laplacian2[k].ptr<float>(y), channelWeights2.ptr<float>(y), level.ptr<float>(y), n);
+        }
+    }
+
+    //Collapse the blended pyramid back to full resolution
+    Mat current = laplacian1[BLEND_LEVELS];
+    for (int k = BLEND_LEVELS - 1; k >= 0; k--) {
+        Mat up, sum;
+        pyrUp(current, up, laplacian1[k].size());
+        add(up, laplacian1[k], sum);
+        current = sum;
+    }
+    Mat blended;
+    current.convertTo(blended, warped.type());
+    return blended;
+}
+
+//Composites src into dst through H like warpTiled, but with gain compensation and multi-band blending instead of
+//overwriting. dst already holds the other image, whose centre is at centre
+//Only the rows src can reach (plus the blur reach of the coarsest level) are touched, a band of rows at a time. Each
+//band is padded with margin rows of context on both sides, which are read as they were before any blending
+void blendInto(const Mat& src, Mat& dst, const Mat& H, Point2f centre) {
+    int margin = 8 << BLEND_LEVELS;
+    Rect area = projectedBounds(src.size(), H);
+    area = Rect(area.x - margin, area.y - margin, area.width + 2 * margin, area.height + 2 * margin) & Rect(0, 0, dst.cols, dst.rows);
+    if (area.width <= 0 || area.height <= 0) {return;}
+
+    double gain1, gain2;
+    overlapGains(src, dst, H, area, gain1, gain2);
+    printf("Gains: %.3f for the warped image, %.3f for the mosaic\n", gain1, gain2);
+    if (gain2 != 1) {
+        dst.convertTo(dst, dst.type(), gain2);
+    }
+
+    Mat H64;
+    H.convertTo(H64, CV_64F);
+    const double* h = H64.ptr<double>(0);
+    double cx = src.cols / 2.0, cy = src.rows / 2.0;
+    double w = h[6] * cx + h[7] * cy + h[8];
+    Point2f srcCentre((h[0] * cx + h[1] * cy + h[2]) / w, (h[3] * cx + h[4] * cy + h[5]) / w);
+
+    int bandRows = std::max(tileSize, 2 * margin);
+    Mat aboveBand;  //The rows just above the current band, as they were before the previous band was written
+    for (int top = area.y; top < area.y + area.height; top += bandRows) {
+        int bottom = std::min(area.y + area.height, top + bandRows);
+        int bandTop = std::max(area.y, top - margin);
+        int bandBottom = std::min(area.y + area.height, bottom + margin);
+        Rect band(area.x, bandTop, area.width, bandBottom - bandTop);
+
+        Mat mosaic = pooledMat(band.size(), dst.type());
+        dst(band).copyTo(mosaic);
+        if (!aboveBand.empty()) {
+            Mat mosaicAbove = mosaic(Rect(0, 0, band.width, top - bandTop));
+            aboveBand.copyTo(mosaicAbove);
+        }
+        //bandRows is at least 2 * margin, so the next band's top margin is still untouched here
+        int nextBandTop = std::max(area.y, bottom - margin);
+        aboveBand = mosaic(Rect(0, nextBandTop - bandTop, band.width, bottom - nextBandTop)).clone();
+
+        Mat warped = pooledMat(band.size(), src.type());
+        warped.setTo(Scalar(0,0,0));
+        int64 warpStart = getTickCount();
+        warpTiled(src, warped, translation(-band.x, -band.y) * H64);
+        warpMs += (getTickCount() - warpStart) * 1000.0 / getTickFrequency();
+
+        Mat weights1, weights2, covered;
+        Point2f offset(band.x, band.y);
+        seamWeights(warped, mosaic, srcCentre - offset, centre - offset, weights1, weights2, covered);
+        Mat blended = blendBand(warped, gain1, mosaic, weights1, weights2);
+
+        Rect interior(0, top - bandTop, band.width, bottom - top);
+        Mat dstInterior = dst(Rect(band.x, top, band.width, bottom - top));
+        blended(interior).copyTo(dstInterior, covered(interior));
+    }
+}
+
+//Builds the mosaic one output tile at a time and writes each finished tile to dir, so memory use depends on the tile
+//size rather than the mosaic size. frames are drawn in order, later frames on top.
+//dir gets tile_<row>_<col>.png plus tiles.txt describing the layout
+void compositeTiles(const vector<Mat>& frames, const vector<Mat>& homographies, Size canvasSize, const std::string& dir) {
+    int tileRows = (canvasSize.height + tileSize - 1) / tileSize;
+    int tileCols = (canvasSize.width + tileSize - 1) / tileSize;
+    printf("Streaming %d x %d tiles to %s...\n", tileCols, tileRows, dir.c_str());
+
+    vector<Mat> inverses(homographies.size());
+    for (int k = 0; k < homographies.size(); k++) {
+        Mat(homographies[k].inv()).convertTo(inverses[k], CV_64F);
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int t = 0; t < tileRows * tileCols; t++) {
+        int row = t / tileCols;
+        int col = t % tileCols;
+        Rect tile = Rect(col * tileSize, row * tileSize, tileSize, tileSize) & Rect(0, 0, canvasSize.width, canvasSize.height);
+        Mat tileImage(tile.size(), frames[0].type(), Scalar(0,0,0));
+        for (int k = 0; k < frames.size(); k++) {
+            Rect region;
+            if (!sourceRegion(frames[k].size(), inverses[k], tile, region)) {continue;}
+            Mat tileH = translation(-tile.x, -tile.y) * homographies[k] * translation(region.x, region.y);
+            warpPerspective(frames[k](region), tileImage, tileH, tile.size(), INTER_LINEAR, BORDER_TRANSPARENT);
+        }
+        char tileName[64];
+        sprintf(tileName, "/tile_%d_%d.png", row, col);
+        imwrite(dir + tileName, tileImage);
+    }
+
+    FILE* index = fopen((dir + "/tiles.txt").c_str(), "w");
+    if (index == 0) {
+        printf("Could not write %s/tiles.txt\n", dir.c_str());
+        return;
+    }
+    fprintf(index, "width %d\nheight %d\ntile_size %d\nrows %d\ncols %d\nformat tile_<row>_<col>.png\n",
+            canvasSize.width, canvasSize.height, tileSize, tileRows, tileCols);
+    fclose(index);
+}
+
+//Bounding box of an image of the given size after it has been transformed by H
+Rect projectedBounds(Size size, const Mat& H) {
+    vector<Point2f> corners(4);
+    corners[0] = Point2f(0, 0);
+    corners[1] = Point2f(size.width, 0);
+    corners[2] = Point2f(size.width, size.height);
+    corners[3] = Point2f(0, size.height);
+    vector<Point2f> projected(4);
+    Mat projectedMat(projected);
+    perspectiveTransform(Mat(corners), projectedMat, H);
+
+    float minX = projected[0].x, maxX = projected[0].x;
+    float minY = projected[0].y, maxY = projected[0].y;
+    for (int k = 1; k < 4; k++) {
+        minX = std::min(minX, projected[k].x);
+        maxX = std::max(maxX, projected[k].x);
+        minY = std::min(minY, projected[k].y);
+        maxY = std::max(maxY, projected[k].y);
+    }
+    int x = cvFloor(minX);
+    int y = cvFloor(minY);
+    return Rect(x, y, cvCeil(maxX) - x, cvCeil(maxY) - y);
+}
+
+//3x3 homography that shifts by (dx, dy)
+Mat translation(double dx, double dy) {
+    Mat T = Mat::eye(3, 3, CV_64FC1);
+    T.at<double>(0, 2) = dx;
+    T.at<double>(1, 2) = dy;
+    return T;
+}
+
+//Bytes the pool reserves for a request: rounded up to an eighth of its power of two, so slightly different sizes share
+//blocks while no more than 1/8 of a block is wasted
+static size_t poolSizeClass(size_t bytes) {
+    size_t step = 4096;
+    while (step * 16 <= bytes) {step *= 2;}
+    return (bytes + step - 1) / step * step;
+}
+
+//A size.height x size.width Mat of type with undefined contents, backed by a block of bufferPool
+//Each block is a single row Mat the pool keeps one reference to. What it hands out is a view of the block, which
+//shares the block's reference count, so a block is free again as soon as its count is back to 1: when every Mat
+//using it (including copies queued for writing or cached elsewhere) has been released, without any explicit return
+//The smallest free block of the same type that fits is reused, as long as it is at most a quarter larger than asked for
+Mat pooledMat(Size size, int type) {
+    size_t elements = (size_t)size.width * size.height;
+    if (elements == 0) {
+        return Mat(size, type);
+    }
+    Mat view;
+    #pragma omp critical(pool)
+    {
+        int best = -1;
+        size_t inUse = 0, idle = 0;
+        for (int k = 0; k < bufferPool.size(); k++) {
+            const Mat& block = bufferPool[k];
+            size_t bytes = block.cols * block.elemSize();
+            if (*block.refcount > 1) {
+                inUse += bytes;
+                continue;
+            }
+            idle += bytes;
+            if (block.type() == type && block.cols >= elements && block.cols * 4 <= elements * 5 &&
+                (best < 0 || block.cols < bufferPool[best].cols)) {
+                best = k;
+            }
+        }
+
+        if (best < 0) {
+            //Drop idle blocks, oldest first, until the ones left fit the idle limit
+            for (int k = 0; k < bufferPool.size() && idle > POOL_MAX_IDLE_MB * 1024 * 1024; ) {
+                if (*bufferPool[k].refcount > 1) {
+                    k++;
+                    continue;
+                }
+                idle -= bufferPool[k].cols * bufferPool[k].elemSize();
+                bufferPool.erase(bufferPool.begin() + k);
+            }
+            int64 start = getTickCount();
+            size_t elementSize = Mat(1, 1, type).elemSize();
+            bufferPool.push_back(Mat(1, (int)(poolSizeClass(elements * elementSize) / elementSize), type));
+            poolAllocMs += (getTickCount() - start) * 1000.0 / getTickFrequency();
+            poolMisses++;
+            best = bufferPool.size() - 1;
+        } else {
+            poolHits++;
+        }
+        view = bufferPool[best].colRange(0, (int)elements).reshape(0, size.height);
+        inUse += bufferPool[best].cols * bufferPool[best].elemSize();
+        poolHighWater = std::max(poolHighWater, inUse);
+    }
+    return view;
+}
+
+//FERN draws its training views from theRNG(), which is per thread. Seeding it from the pair makes a pair's result
+//independent of which thread ran it and what that thread ran before, so any thread count gives the same answer
+void seedPairRNG(int i, int j) {
+    theRNG() = RNG(0x9e3779b9u + i * 1000003u + j);
+}
+
+//Peak resident set size of the whole process, in KB (Linux reports ru_maxrss in KB)
+long peakRSSKB() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+//Page faults of the whole process so far, minor (first touch of fresh memory) plus major
+long pageFaults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+//CPU time in ms. Inside a parallel loop this is the calling thread's, anywhere else the whole process'
+//so that a stage wrapped around a parallel loop counts the CPU time of all its threads
+double cpuTimeMs() {
+    clockid_t clock = CLOCK_PROCESS_CPUTIME_ID;
+#ifdef _OPENMP
+    if (omp_in_parallel()) {clock = CLOCK_THREAD_CPUTIME_ID;}
+#endif
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1.0e6;
+}
+
+ScopedStage::ScopedStage(const char* name) {
+    record.name = name;
+    record.stitch = currentStitch;
+#ifdef _OPENMP
+    record.thread = omp_get_thread_num();
+#else
+    record.thread = 0;
+#endif
+    startTicks = getTickCount();
+    startCpuMs = cpuTimeMs();
+    startFaults = pageFaults();
+}
+
+void ScopedStage::set(const char* key, double value) {
+    record.values.push_back(std::make_pair(std::string(key), value));
+}
+
+ScopedStage::~ScopedStage() {
+    if (tracePath.empty()) {
+        return;
+    }
+    double tickMs = 1000.0 / getTickFrequency();
+    record.startMs = (startTicks - traceStartTicks) * tickMs;
+    record.wallMs = (getTickCount() - startTicks) * tickMs;
+    record.cpuMs = cpuTimeMs() - startCpuMs;
+    record.peakRSSKB = peakRSSKB();
+    record.pageFaults = pageFaults() - startFaults;
+    #pragma omp critical(trace)
+    traceRecords.push_back(record);
+}
+
+//Writes every recorded stage to tracePath in traceFormat. Stages are in the order they finished
+void writeTrace() {
+    if (tracePath.empty()) {
+        return;
+    }
+    FILE* file = fopen(tracePath.c_str(), "w");
+    if (!file) {
+        printf("Could not write trace to %s\n", tracePath.c_str());
+        return;
+    }
+
+    if (traceFormat == TRACE_CSV) {
+        //Counters differ between stages, so they go in one key=value;... column
+        fprintf(file, "stage,stitch,thread,start_ms,wall_ms,cpu_ms,peak_rss_kb,page_faults,counters\n");
+        for (int r = 0; r < traceRecords.size(); r++) {
+            const StageRecord& record = traceRecords[r];
+            fprintf(file, "%s,%d,%d,%.3f,%.3f,%.3f,%ld,%ld,", record.name.c_str(), record.stitch, record.thread,
+                    record.startMs, record.wallMs, record.cpuMs, record.peakRSSKB, record.pageFaults);
+            for (int v = 0; v < record.values.size(); v++) {
+                fprintf(file, "%s%s=%g", v > 0 ? ";" : "", record.values[v].first.c_str(), record.values[v].second);
+            }
+            fprintf(file, "\n");
+        }
+    } else if (traceFormat == TRACE_CHROME) {
+        //Complete events ("ph": "X") with times in microseconds, one row per thread
+        fprintf(file, "{\"traceEvents\": [\n");
+        for (int r = 0; r < traceRecords.size(); r++) {
+            const StageRecord& record = traceRecords[r];
+            fprintf(file, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.0f, \"dur\": %.0f, \"args\": {",
+                    record.name.c_str(), record.thread, record.startMs * 1000, record.wallMs * 1000);
+            fprintf(file, "\"stitch\": %d, \"cpu_ms\": %.3f, \"peak_rss_kb\": %ld, \"page_faults\": %ld",
+                    record.stitch, record.cpuMs, record.peakRSSKB, record.pageFaults);
+            for (int v = 0; v < record.values.size(); v++) {
+                fprintf(file, ", \"%s\": %g", record.values[v].first.c_str(), record.values[v].second);
+            }
+            fprintf(file, "}}%s\n", r + 1 < traceRecords.size() ? "," : "");
+        }
+        fprintf(file, "], \"displayTimeUnit\": \"ms\"}\n");
+    } else {
+        fprintf(file, "[\n");
+        for (int r = 0; r < traceRecords.size(); r++) {
+            const StageRecord& record = traceRecords[r];
+            fprintf(file, "  {\"stage\": \"%s\", \"stitch\": %d, \"thread\": %d, \"start_ms\": %.3f, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"peak_rss_kb\": %ld, \"page_faults\": %ld",
+                    record.name.c_str(), record.stitch, record.thread, record.startMs, record.wallMs, record.cpuMs, record.peakRSSKB, record.pageFaults);
+            for (int v = 0; v < record.values.size(); v++) {
+                fprintf(file, ", \"%s\": %g", record.values[v].first.c_str(), record.values[v].second);
+            }
+            fprintf(file, "}%s\n", r + 1 < traceRecords.size() ? "," : "");
+        }
+        fprintf(file, "]\n");
+    }
+    fclose(file);
+    printf("Wrote %d stages to %s\n", (int)traceRecords.size(), tracePath.c_str());
+}
+
+//PSNR in dB between two images of the same size and type, 8 bit range
+double peakSignalToNoise(const Mat& a, const Mat& b) {
+    double error = norm(a, b, NORM_L2);
+    double mse = error * error / ((double)a.total() * a.channels());
+    if (mse <= 0) {
+        return 100;
+    }
+    return 10 * log10(255.0 * 255.0 / mse);
+}
+
+//Mean SSIM between two 8 bit grayscale images of the same size, with the usual 11x11 Gaussian window (sigma 1.5)
+//and constants from Wang et al. 2004
+double structuralSimilarity(const Mat& a, const Mat& b) {
+    const double C1 = (0.01 * 255) * (0.01 * 255);
+    const double C2 = (0.03 * 255) * (0.03 * 255);
+    Mat x, y;
+    a.convertTo(x, CV_32F);
+    b.convertTo(y, CV_32F);
+    Mat xx, yy, xy;
+    multiply(x, x, xx);
+    multiply(y, y, yy);
+    multiply(x, y, xy);
+
+    Mat muX, muY, sigmaXX, sigmaYY, sigmaXY;
+    GaussianBlur(x, muX, Size(11, 11), 1.5);
+    GaussianBlur(y, muY, Size(11, 11), 1.5);
+    GaussianBlur(xx, sigmaXX, Size(11, 11), 1.5);
+    GaussianBlur(yy, sigmaYY, Size(11, 11), 1.5);
+    GaussianBlur(xy, sigmaXY, Size(11, 11), 1.5);
+    Mat muXX, muYY, muXY;
+    multiply(muX, muX, muXX);
+    multiply(muY, muY, muYY);
+    multiply(muX, muY, muXY);
+    subtract(sigmaXX, muXX, sigmaXX);
+    subtract(sigmaYY, muYY, sigmaYY);
+    subtract(sigmaXY, muXY, sigmaXY);
+
+    //((2 muX muY + C1)(2 sigmaXY + C2)) / ((muX^2 + muY^2 + C1)(sigmaX^2 + sigmaY^2 + C2))
+    Mat t1, t2, numerator, denominator;
+    muXY.convertTo(t1, CV_32F, 2, C1);
+    sigmaXY.convertTo(t2, CV_32F, 2, C2);
+    multiply(t1, t2, numerator);
+    add(muXX, muYY, t1);
+    t1.convertTo(t1, CV_32F, 1, C1);
+    add(sigmaXX, sigmaYY, t2);
+    t2.convertTo(t2, CV_32F, 1, C2);
+    multiply(t1, t2, denominator);
+    Mat ssimMap;
+    divide(numerator, denominator, ssimMap);
+    return mean(ssimMap)[0];
+}
+
+//Crops toCrop to a rectangular image, either to the bounding box of the non-black pixels
+//or to the largest rectangle that contains no black pixels at all
+Mat cropBlack(Mat toCrop, Mat toCropGray, int mode) {
+    ScopedStage stage("crop_black");
+    stage.set("mode", mode);
+    Rect cropRect = (mode == CROP_INSCRIBED) ? largestInscribedRect(toCropGray) : nonZeroBounds(toCropGray);
+    printf("Crop x: %d, y: %d, width: %d, height: %d\n", cropRect.x, cropRect.y, cropRect.width, cropRect.height);
+    if (cropRect.width <= 0 || cropRect.height <= 0) {
+        return toCrop;
+    }
+    return toCrop(cropRect);
+}
+
+//Index of the first non-zero byte in row[0, n), or n if there is none
+//Compares 32 (AVX2) or 16 (SSE2) bytes at a time against zero and only looks at single bytes once a block hits
+static inline int firstNonZero(const uchar* row, int n) {
+    int j = 0;
+#if defined(__AVX2__)
+    const __m256i zero32 = _mm256_setzero_si256();
+    for (; j + 32 <= n; j += 32) {
+        unsigned int zeros = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(row + j)), zero32));
+        if (zeros != 0xFFFFFFFFu) {return j + __builtin_ctz(~zeros);}
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i zero16 = _mm_setzero_si128();
+    for (; j + 16 <= n; j += 16) {
+        int zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + j)), zero16));
+        if (zeros != 0xFFFF) {return j + __builtin_ctz(~zeros & 0xFFFF);}
+    }
+#endif
+    for (; j < n; j++) {
+        if (row[j] != 0) {return j;}
+    }
+    return n;
+}
+
+//Index of the last non-zero byte in row[0, n), or -1 if there is none
+static inline int lastNonZero(const uchar* row, int n) {
+    int j = n;
+#if defined(__AVX2__)
+    const __m256i zero32 = _mm256_setzero_si256();
+    for (; j - 32 >= 0; j -= 32) {
+        unsigned int zeros = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(row + j - 32)), zero32));
+        if (zeros != 0xFFFFFFFFu) {return j - 32 + 31 - __builtin_clz(~zeros);}
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i zero16 = _mm_setzero_si128();
+    for (; j - 16 >= 0; j -= 16) {
+        int zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + j - 16)), zero16));
+        if (zeros != 0xFFFF) {return j - 16 + 31 - __builtin_clz(~zeros & 0xFFFF);}
+    }
+#endif
+    for (j = j - 1; j >= 0; j--) {
+        if (row[j] != 0) {return j;}
+    }
+    return -1;
+}
+
+//Bounding box of the non-zero pixels of an 8 bit single channel image
+//Rows are scanned in from the top and bottom until they hit something, then each remaining row only has to be
+//checked outside the columns already known to be inside the box, so a well-filled image is mostly skipped
+Rect nonZeroBounds(const Mat& gray) {
+    int top = 0;
+    while (top < gray.rows && firstNonZero(gray.ptr(top), gray.cols) == gray.cols) {top++;}
+    if (top == gray.rows) {
+        return Rect();
+    }
+    int bottom = gray.rows - 1;
+    while (firstNonZero(gray.ptr(bottom), gray.cols) == gray.cols) {bottom--;}
+
+    int left = gray.cols;
+    int right = -1;
+    for (int i = top; i <= bottom; i++) {
+        const uchar* row = gray.ptr(i);
+        left = firstNonZero(row, left);
+        int last = lastNonZero(row + right + 1, gray.cols - right - 1);
+        if (last >= 0) {right = right + 1 + last;}
+        if (left == 0 && right == gray.cols - 1) {break;}
+    }
+    return Rect(left, top, right - left + 1, bottom - top + 1);
+}
+
+//Largest axis aligned rectangle containing only non-zero pixels
+//Standard maximal rectangle search: keep the height of the run of non-zero pixels above each column, then find the
+//largest rectangle under that histogram for every row with a stack. O(rows * cols), one int per column of memory.
+//Only the bounding box is searched, and genuinely black pixels inside the picture will also be avoided
+Rect largestInscribedRect(const Mat& gray) {
+    Rect bounds = nonZeroBounds(gray);
+    if (bounds.width <= 0 || bounds.height <= 0) {
+        return bounds;
+    }
+    Mat region = gray(bounds);
+    vector<int> heights(region.cols + 1, 0);
+    vector<int> stack;
+    stack.reserve(region.cols + 1);
+    Rect best = Rect();
+    for (int i = 0; i < region.rows; i++) {
+        const uchar* row = region.ptr(i);
+        for (int j = 0; j < region.cols; j++) {
+            heights[j] = row[j] ? heights[j] + 1 : 0;
+        }
+        //heights[cols] stays 0 so everything is popped at the end of the row
+        stack.clear();
+        for (int j = 0; j <= region.cols; j++) {
+            while (!stack.empty() && heights[stack.back()] >= heights[j]) {
+                int h = heights[stack.back()];
+                stack.pop_back();
+                int start = stack.empty() ? 0 : stack.back() + 1;
+                if (h * (j - start) > best.area()) {
+                    best = Rect(start, i - h + 1, j - start, h);
+                }
+            }
+            stack.push_back(j);
+        }
+    }
+    return Rect(best.x + bounds.x, best.y + bounds.y, best.width, best.height);
+}
+
+//The per-pixel loop cropBlack used to run, kept as the baseline for benchmarkCrop
+static Rect cropBlackLoop(const Mat& toCropGray) {
+    int minCol = toCropGray.cols;
+    int minRow = toCropGray.rows;
+    int maxCol = 0;
+    int maxRow = 0;
+    for (int i = 0; i < toCropGray.rows - 3; i++) {
+        for (int j = 0; j < toCropGray.cols; j++) {
+            if (toCropGray.at<char>(i, j) != 0) {
+                if (i < minRow) {minRow = i;}
+                if (j < minCol) {minCol = j;}
+                if (i > maxRow) {maxRow = i;}
+                if (j > maxCol) {maxCol = j;}
+            }
+        }
+    }
+    return Rect(minCol, minRow, maxCol - minCol, maxRow - minRow);
+}
+
+//Builds the canvases the old stitchImages produced (image in the centre of a 3x black canvas, then a perspective
+//warped copy so there are wedges) and times the old loop against nonZeroBounds and largestInscribedRect
+void benchmarkCrop(const vector<std::string>& imgNames) {
+    const int reps = 5;
+    printf("%-40s %12s %12s %12s %12s\n", "image", "canvas MP", "loop ms", "bounds ms", "inscribed ms");
+    for (int n = 0; n < imgNames.size(); n++) {
+        Mat img = imread(imgNames[n].c_str(), 0);
+        if (img.empty()) {
+            printf("Could not read %s\n", imgNames[n].c_str());
+            continue;
+        }
+        //Make real black pixels non-zero so only the canvas around the image counts as black
+        Mat blackPixels;
+        compare(img, 0, blackPixels, CMP_EQ);
+        img.setTo(Scalar(1), blackPixels);
+
+        Mat canvas(img.rows * 3, img.cols * 3, CV_8UC1, Scalar(0));
+        Mat centre = canvas(Rect(img.cols, img.rows, img.cols, img.rows));
+        img.copyTo(centre);
+        //Keystone the image a little to the right of the centre, like a typical neighbouring frame
+        Point2f src[4] = {Point2f(0, 0), Point2f(img.cols, 0), Point2f(img.cols, img.rows), Point2f(0, img.rows)};
+        Point2f dst[4] = {Point2f(img.cols * 1.6f, img.rows * 0.9f), Point2f(img.cols * 2.5f, img.rows * 0.8f),
+                          Point2f(img.cols * 2.5f, img.rows * 2.2f), Point2f(img.cols * 1.6f, img.rows * 2.1f)};
+        warpPerspective(img, canvas, getPerspectiveTransform(src, dst), canvas.size(), INTER_LINEAR, BORDER_TRANSPARENT);
+
+        double loopMs = 0, boundsMs = 0, inscribedMs = 0;
+        Rect loopRect, boundsRect, inscribedRect;
+        for (int r = 0; r < reps; r++) {
+            int64 t0 = getTickCount();
+            loopRect = cropBlackLoop(canvas);
+            int64 t1 = getTickCount();
+            boundsRect = nonZeroBounds(canvas);
+            int64 t2 = getTickCount();
+            inscribedRect = largestInscribedRect(canvas);
+            int64 t3 = getTickCount();
+            loopMs += (t1 - t0) * 1000.0 / getTickFrequency() / reps;
+            boundsMs += (t2 - t1) * 1000.0 / getTickFrequency() / reps;
+            inscribedMs += (t3 - t2) * 1000.0 / getTickFrequency() / reps;
+        }
+        printf("%-40s %12.1f %12.2f %12.2f %12.2f\n", imgNames[n].c_str(), canvas.total() / 1.0e6, loopMs, boundsMs, inscribedMs);
+        //The old loop's box is one pixel short on the right and bottom
+        if (loopRect.x != boundsRect.x || loopRect.y != boundsRect.y ||
+            loopRect.width + 1 != boundsRect.width || loopRect.height + 1 != boundsRect.height) {
+            printf("  bounds differ: loop %d,%d %dx%d vs %d,%d %dx%d\n", loopRect.x, loopRect.y, loopRect.width, loopRect.height,
+                   boundsRect.x, boundsRect.y, boundsRect.width, boundsRect.height);
+        }
+        printf("  inscribed %d,%d %dx%d\n", inscribedRect.x, inscribedRect.y, inscribedRect.width, inscribedRect.height);
+    }
+}
+
+//Warps each image onto a canvas with a keystone homography, once with warpPerspective and once with warpTiled, and
+//compares time and pixels. Returns non-zero if any image differs beyond the WARP_CHECK_* tolerances
+int benchmarkWarp(const vector<std::string>& imgNames) {
+    int failed = 0;
+    printf("%-40s %12s %12s %12s %12s %12s\n", "image", "canvas MP", "full ms", "tiled ms", "mean diff", "outliers");
+    for (int n = 0; n < imgNames.size(); n++) {
+        Mat img = imread(imgNames[n].c_str(), 1);
+        if (img.empty()) {
+            printf("Could not read %s\n", imgNames[n].c_str());
+            failed++;
+            continue;
+        }
+        Point2f src[4] = {Point2f(0, 0), Point2f(img.cols, 0), Point2f(img.cols, img.rows), Point2f(0, img.rows)};
+        Point2f dst[4] = {Point2f(img.cols * 0.1f, img.rows * 0.2f), Point2f(img.cols * 1.3f, img.rows * 0.05f),
+                          Point2f(img.cols * 1.4f, img.rows * 1.5f), Point2f(img.cols * 0.05f, img.rows * 1.3f)};
+        Mat H = getPerspectiveTransform(src, dst);
+        Mat full(img.rows * 3 / 2 + 1, img.cols * 3 / 2 + 1, img.type(), Scalar(0,0,0));
+        Mat tiled = full.clone();
+
+        int64 t0 = getTickCount();
+        warpPerspective(img, full, H, full.size(), INTER_LINEAR, BORDER_TRANSPARENT);
+        int64 t1 = getTickCount();
+        warpTiled(img, tiled, H);
+        int64 t2 = getTickCount();
+
+        Mat difference;
+        absdiff(full, tiled, difference);
+        difference = difference.reshape(1);
+        double meanDiff = mean(difference)[0];
+        double outliers = (double)countNonZero(difference > WARP_CHECK_OUTLIER_LEVELS) / difference.total();
+        printf("%-40s %12.1f %12.2f %12.2f %12.3f %11.4f%%\n", imgNames[n].c_str(), full.total() / 1.0e6,
+               (t1 - t0) * 1000.0 / getTickFrequency(), (t2 - t1) * 1000.0 / getTickFrequency(), meanDiff, outliers * 100);
+        if (meanDiff > WARP_CHECK_MAX_MEAN_DIFF || outliers > WARP_CHECK_MAX_OUTLIERS) {
+            printf("  MISMATCH, tiles differ from the full warp beyond the tolerance\n");
+            failed++;
+        }
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+//Word counts of descriptors (one per row) against retrievalVocabulary, by nearest word centre
+static Mat wordHistogram(const Mat& descriptors) {
+    Mat histogram(1, retrievalVocabulary.rows, CV_32F, Scalar(0));
+    Mat values;
+    descriptors.convertTo(values, CV_32F);
+    for (int r = 0; r < values.rows; r++) {
+        const float* d = values.ptr<float>(r);
+        int bestWord = 0;
+        float bestDistance = FLT_MAX;
+        for (int w = 0; w < retrievalVocabulary.rows; w++) {
+            const float* centre = retrievalVocabulary.ptr<float>(w);
+            float distance = 0;
+            for (int k = 0; k < values.cols && distance < bestDistance; k++) {
+                float diff = d[k] - centre[k];
+                distance += diff * diff;
+            }
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                bestWord = w;
+            }
+        }
+        histogram.at<float>(0, bestWord) += 1;
+    }
+    return histogram;
+}
+
+//Clusters up to RETRIEVAL_SAMPLES_PER_IMAGE ranking descriptors of each image into RETRIEVAL_WORDS words
+//Built once from the input images, stitched mosaics are described with the same words
+static void buildVocabulary(const vector<Mat>& imgs, const vector<int>& images) {
+    vector<Mat> sampled;
+    int rows = 0;
+    for (int k = 0; k < images.size(); k++) {
+        const Mat& descriptors = getFeatures(imgs, images[k], MATCH_SURF_THRESHOLD, pyramidLevels, true).descriptors;
+        int step = std::max(1, descriptors.rows / RETRIEVAL_SAMPLES_PER_IMAGE);
+        for (int r = 0; r < descriptors.rows; r += step) {
+            sampled.push_back(descriptors.row(r));
+            rows++;
+        }
+    }
+    int words = std::min(RETRIEVAL_WORDS, rows);
+    if (words < 2) {return;}
+    Mat samples(rows, sampled[0].cols, CV_32F);
+    for (int r = 0; r < rows; r++) {
+        Mat sample = samples.row(r);
+        sampled[r].convertTo(sample, CV_32F);
+    }
+
+    printf("Clustering %d descriptors into %d visual words...\n", rows, words);
+    seedPairRNG(-1, -1);
+    Mat labels;
+    kmeans(samples, words, labels, TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 20, 1e-3), 1, KMEANS_PP_CENTERS, retrievalVocabulary);
+}
+
+//The pairs the --retrieval pre-filter lets through to full matching: keep(i, j) (i < j) is non-zero if either image
+//is among the other's retrievalNeighbours most similar, by cosine similarity of tf-idf weighted word histograms
+Mat retrievalCandidates(const vector<Mat>& imgs) {
+    int n = imgs.size();
+    Mat keep(n, n, CV_8U, Scalar(1));
+    vector<int> images;
+    for (int i = 0; i < n; i++) {
+        if (!imgs[i].empty()) {images.push_back(i);}
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int k = 0; k < (int)images.size(); k++) {
+        if (retrievalHistograms[images[k]].empty()) {
+            getFeatures(imgs, images[k], MATCH_SURF_THRESHOLD, pyramidLevels, true);
+        }
+    }
+    if (retrievalVocabulary.empty()) {
+        buildVocabulary(imgs, images);
+        if (retrievalVocabulary.empty()) {
+            printf("Too few descriptors for a vocabulary, matching every pair\n");
+            return keep;
+        }
+    }
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int k = 0; k < (int)images.size(); k++) {
+        if (retrievalHistograms[images[k]].empty()) {
+            retrievalHistograms[images[k]] = wordHistogram(getFeatures(imgs, images[k], MATCH_SURF_THRESHOLD, pyramidLevels, true).descriptors);
+        }
+    }
+
+    //Words that show up in every image say nothing about which images overlap
+    int words = retrievalVocabulary.rows;
+    vector<double> idf(words, 0);
+    for (int w = 0; w < words; w++) {
+        int containing = 0;
+        for (int k = 0; k < images.size(); k++) {
+            if (retrievalHistograms[images[k]].at<float>(0, w) > 0) {containing++;}
+        }
+        if (containing > 0) {idf[w] = log((double)images.size() / containing);}
+    }
+    vector<Mat> signatures(images.size());
+    for (int k = 0; k < images.size(); k++) {
+        const Mat& histogram = retrievalHistograms[images[k]];
+        double total = std::max(1.0, (double)sum(histogram)[0]);
+        signatures[k] = Mat(1, words, CV_32F);
+        for (int w = 0; w < words; w++) {
+            signatures[k].at<float>(0, w) = (float)(histogram.at<float>(0, w) / total * idf[w]);
+        }
+        normalize(signatures[k], signatures[k]);
+    }
+
+    keep.setTo(Scalar(0));
+    for (int a = 0; a < images.size(); a++) {
+        vector<std::pair<double, int> > similar;
+        for (int b = 0; b < images.size(); b++) {
+            if (b != a) {similar.push_back(std::make_pair(-signatures[a].dot(signatures[b]), images[b]));}
+        }
+        int neighbours = std::min((int)similar.size(), retrievalNeighbours);
+        std::partial_sort(similar.begin(), similar.begin() + neighbours, similar.end());
+        printf("Retrieval neighbours of %d:", images[a]);
+        for (int k = 0; k < neighbours; k++) {
+            int i = std::min(images[a], similar[k].second);
+            int j = std::max(images[a], similar[k].second);
+            keep.at<uchar>(i, j) = 1;
+            printf(" %d (%.2f)", similar[k].second, -similar[k].first);
+        }
+        printf("\n");
+    }
+    return keep;
+}
+
+//Takes back the count of a pair pruned to -4 that is about to be matched after all. Without --retrieval-check it was
+//counted as saved from the matcher. With it, it was matched (and counted) once already, and the second match replaces it
+static void unprunePair() {
+    prunedPairs--;
+    if (retrievalCheck) {matcherCalls--;}
+}
+
+//Looks for the next images to stitch together by "quickly" testing all permutations
+vector<int> findBestMatch(vector<Mat> imgs, Ptr<GenericDescriptorMatcher> descriptorMatcher) {
+    //Use a high threshold so as to get fewer and stronger keypoints
+    //Tweak this value, lower values detects more keypoints
+    //If you get a failure on this step, it's probably because 0 matches were found, so reduce the threshold
+    //20.0e3 worked well for horizontal I think
+    //For demo:
+    //horizontalAndVertical: 9.0e3
+    //blurring: 14.0e3
+    //horizontal: 20.0e3
+    //This is MATCH_SURF_THRESHOLD, keypoints are kept in the feature cache between calls
+
+    //With --retrieval, only the pairs the pre-filter keeps are scored. Pruned pairs are looked at again on every call,
+    //since stitching changes which images are left to be neighbours
+    Mat keep;
+    if (retrievalNeighbours > 0 && !retrievalExhaustive) {
+        ScopedStage stage("retrieval");
+        keep = retrievalCandidates(imgs);
+        int pruned = 0;
+        for (int i = 0; i < imgs.size(); i++) {
+            for (int j = i + 1; j < imgs.size(); j++) {
+                float& score = avgMatchDistances.at<float>(i, j);
+                bool pending = (score == -1);
+                if (score == -4 && keep.at<uchar>(i, j)) {
+                    //A candidate again, so it will be matched after all
+                    score = -1;
+                    unprunePair();
+                }
+                if (score == -1 && !keep.at<uchar>(i, j) && !retrievalCheck) {
+                    score = -4;
+                    pruned++;
+                    //Only count pairs that would have been scored, a pair stays pruned without costing a match
+                    if (pending) {prunedPairs++;}
+                }
+            }
+        }
+        stage.set("pruned", pruned);
+    }
+
+    //Collect the pairs that need (re)scoring and the images they need features for
+    vector<Point> pendingPairs;
+    vector<int> pendingImages;
+    vector<bool> imageNeeded(imgs.size(), false);
+    vector<bool> trainNeeded(imgs.size(), false);
+    for (int i = 0; i < imgs.size(); i++) {
+        for (int j = i + 1; j < imgs.size(); j++) {
+            float stored;
+            Mat unusedH;
+            vector<Point2f> unusedPoints1, unusedPoints2;
+            vector<uchar> unusedMask;
+            if (avgMatchDistances.at<float>(i, j) == -1 && loadPairResult(i, j, PAIR_SCORE, stored, unusedH, unusedPoints1, unusedPoints2, unusedMask)) {
+                printf("Loaded the score of %d and %d from the feature store: %f\n", i, j, stored);
+                avgMatchDistances.at<float>(i, j) = stored;
+            }
+            if (avgMatchDistances.at<float>(i, j) == -1) {
+                printf("Must recalculate match between %d and %d\n", i, j);
+                pendingPairs.push_back(Point(i, j));
+                imageNeeded[i] = true;
+                imageNeeded[j] = true;
+                trainNeeded[j] = true;
+            }
+        }
+    }
+    for (int i = 0; i < imgs.size(); i++) {
+        if (imageNeeded[i]) {pendingImages.push_back(i);}
+    }
+    matcherCalls += pendingPairs.size();
+
+    //Each image lives in its own cache slot, so extraction can run one image per thread
+    //With --pyramid, ranking happens entirely on the downscaled images
+    {
+        ScopedStage stage("extract_features");
+        stage.set("images", pendingImages.size());
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int k = 0; k < (int)pendingImages.size(); k++) {
+            getFeatures(imgs, pendingImages[k], MATCH_SURF_THRESHOLD, pyramidLevels);
+            //j is always the train image, so only those need a model
+            if (trainNeeded[pendingImages[k]]) {
+                trainModel(imgs, pendingImages[k], MATCH_SURF_THRESHOLD, pyramidLevels, descriptorMatcher);
+            }
+        }
+    }
+
+    //Every pair writes only its own cell of avgMatchDistances, so pairs can be scored in any order
+    //Dynamic scheduling hands the next pair to whichever thread finishes first, which keeps all cores busy
+    //even though FERN training time varies a lot between images
+    ScopedStage scoreStage("score_pairs");
+    scoreStage.set("pairs", pendingPairs.size());
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int p = 0; p < (int)pendingPairs.size(); p++) {
+        int i = pendingPairs[p].x;
+        int j = pendingPairs[p].y;
+        ScopedStage stage("match_pair");
+        stage.set("image1", i);
+        stage.set("image2", j);
+
+        //match() swaps the train keypoints back into its argument, so each pair works on its own copies
+        FeatureSet features1 = getFeatures(imgs, i, MATCH_SURF_THRESHOLD, pyramidLevels);
+        FeatureSet features2 = getFeatures(imgs, j, MATCH_SURF_THRESHOLD, pyramidLevels);
+
+        seedPairRNG(i, j);
+
+        if (rankByInliers) {
+            //Scored so that lower is better like a distance, and always positive
+            vector<Point2f> points1, points2;
+            vector<uchar> inlierMask;
+            Mat H = findPairHomography(pyramidImage(imgs, i, pyramidLevels), pyramidImage(imgs, j, pyramidLevels), features1, features2, descriptorMatcher, points1, points2, inlierMask);
+            int inliers = H.empty() ? 0 : countNonZero(Mat(inlierMask));
+            avgMatchDistances.at<float>(i, j) = 1.0f / (1 + inliers);
+            storePairResult(i, j, PAIR_SCORE, avgMatchDistances.at<float>(i, j), Mat(), vector<Point2f>(), vector<Point2f>(), vector<uchar>());
+            stage.set("matches", points1.size());
+            stage.set("inliers", inliers);
+            printf("Got %d matches between %d and %d, %d inliers\n", (int)points1.size(), i, j, inliers);
+            continue;
+        }
+
+        vector<DMatch> matches1to2;
+        matchFeatures(pyramidImage(imgs, i, pyramidLevels), features1, pyramidImage(imgs, j, pyramidLevels), features2, descriptorMatcher, matches1to2);
+
+        float sum = 0;
+        for (int k = 0; k < matches1to2.size(); k++) {sum += matches1to2[k].distance;}
+        avgMatchDistances.at<float>(i, j) = sum / matches1to2.size();
+        storePairResult(i, j, PAIR_SCORE, avgMatchDistances.at<float>(i, j), Mat(), vector<Point2f>(), vector<Point2f>(), vector<uchar>());
+        stage.set("keypoints1", features1.keypoints.size());
+        stage.set("keypoints2", features2.keypoints.size());
+        stage.set("matches", matches1to2.size());
+        printf("Got %d matches between %d and %d, average match distance %f\n", (int)matches1to2.size(), i, j, avgMatchDistances.at<float>(i, j));
+    }
+
+    //With --retrieval-check every pending pair was scored, so see whether each image's best match survived the
+    //pre-filter, then prune as it would have been
+    if (!keep.empty() && retrievalCheck) {
+        for (int i = 0; i < imgs.size(); i++) {
+            if (!imageNeeded[i]) {continue;}
+            int best = -1;
+            for (int j = 0; j < imgs.size(); j++) {
+                float score = avgMatchDistances.at<float>(std::min(i, j), std::max(i, j));
+                if (j != i && score > 0 && (best < 0 || score < avgMatchDistances.at<float>(std::min(i, best), std::max(i, best)))) {best = j;}
+            }
+            if (best < 0) {continue;}
+            recallQueries++;
+            if (keep.at<uchar>(std::min(i, best), std::max(i, best))) {recallHits++;}
+        }
+        for (int p = 0; p < (int)pendingPairs.size(); p++) {
+            if (!keep.at<uchar>(pendingPairs[p].x, pendingPairs[p].y)) {
+                avgMatchDistances.at<float>(pendingPairs[p].x, pendingPairs[p].y) = -4;
+                prunedPairs++;
+            }
+        }
+    }
+
+    float minDistance = 9001;
+    int minIndex1 = -1;
+    int minIndex2 = -1;
+    for (int i = 0; i < imgs.size(); i++) {
+        for (int j = i + 1; j < imgs.size(); j++) {
+            if (avgMatchDistances.at<float>(i, j) > 0) {
+                printf("Average match distance between %d and %d was %f\n", i, j, avgMatchDistances.at<float>(i, j));
+                if (avgMatchDistances.at<float>(i, j) < minDistance) {
+                    minDistance = avgMatchDistances.at<float>(i, j);
+                    minIndex1 = i;
+                    minIndex2 = j;
+                }
+            }
+        }
+    }
+    vector<int> minIndexes;
+    if (minIndex1 < 0) {
+        //The pre-filter may have pruned the only pairs that still connect the pieces, so match those before giving up
+        int restored = 0;
+        for (int i = 0; i < imgs.size(); i++) {
+            for (int j = i + 1; j < imgs.size(); j++) {
+                if (avgMatchDistances.at<float>(i, j) == -4) {
+                    avgMatchDistances.at<float>(i, j) = -1;
+                    unprunePair();
+                    restored++;
+                }
+            }
+        }
+        if (restored > 0) {
+            printf("No retrieval candidates left to try, matching the %d pruned pairs\n", restored);
+            retrievalExhaustive = true;
+            minIndexes = findBestMatch(imgs, descriptorMatcher);
+            retrievalExhaustive = false;
+            return minIndexes;
+        }
+        printf("No pairs left to try\n");
+        return minIndexes;
+    }
+    printf("Best match was between %d and %d: %f\n", minIndex1, minIndex2, minDistance);
+    minIndexes.push_back(minIndex1);
+    minIndexes.push_back(minIndex2);
+    return minIndexes;
+}
+
+//Updates avgMatchDistances once imgs[index2] has been stitched into imgs[index1]
+void markStitched(int index1, int index2) {
+    //Now anything involving index1 will need to be recalculated, including pairs that were rejected before
+    for (int i = 0; i < avgMatchDistances.rows; i++) {
+        if (avgMatchDistances.at<float>(i, index1) != -2) {
+            avgMatchDistances.at<float>(i, index1) = -1;
+            avgMatchDistances.at<float>(index1, i) = -1;
+        }
+    }
+
+    //And since index2 will be deleted, we must indicate this using -2
+    for (int i = 0; i < avgMatchDistances.rows; i++) {
+        avgMatchDistances.at<float>(i, index2) = -2;
+        avgMatchDistances.at<float>(index2, i) = -2;
+    }
+}
+
+//Cheap checks that H, taking an image of size1 into another image's frame, is a plausible camera motion
+//Only looks at the inlier mask and at H itself, so it costs nothing next to a warp. Prints why H was rejected
+bool validateHomography(const Mat& H, const vector<uchar>& inlierMask, Size size1) {
+    int inliers = countNonZero(Mat(inlierMask));
+    double inlierRatio = inlierMask.empty() ? 0 : (double)inliers / inlierMask.size();
+    if (inliers < MIN_HOMOGRAPHY_INLIERS || inlierRatio < MIN_INLIER_RATIO) {
+        printf("Rejected homography: %d inliers (%.0f%% of the matches)\n", inliers, inlierRatio * 100);
+        return false;
+    }
+    if (fabs(H.at<double>(2, 2)) < 1e-12) {
+        printf("Rejected homography: degenerate\n");
+        return false;
+    }
+    Mat normalised = H / H.at<double>(2, 2);
+    const double* h = normalised.ptr<double>(0);
+
+    //The linear part has to keep orientation and not squash one direction much more than the other
+    //Its singular values come straight from the 2x2 entries
+    double det = h[0] * h[4] - h[1] * h[3];
+    if (det <= 0) {
+        printf("Rejected homography: determinant %g flips the image\n", det);
+        return false;
+    }
+    double squares = h[0] * h[0] + h[1] * h[1] + h[3] * h[3] + h[4] * h[4];
+    double root = sqrt(std::max(0.0, squares * squares - 4 * det * det));
+    double condition = sqrt((squares + root) / (squares - root));
+    if (!(condition <= MAX_HOMOGRAPHY_CONDITION)) {
+        printf("Rejected homography: condition number %.1f\n", condition);
+        return false;
+    }
+
+    //Every corner has to stay in front of the camera and the projected outline has to be convex
+    double cornerX[4] = {0, (double)size1.width, (double)size1.width, 0};
+    double cornerY[4] = {0, 0, (double)size1.height, (double)size1.height};
+    double px[4], py[4];
+    for (int k = 0; k < 4; k++) {
+        double w = h[6] * cornerX[k] + h[7] * cornerY[k] + h[8];
+        if (w <= 0) {
+            printf("Rejected homography: corner %d lands behind the camera\n", k);
+            return false;
+        }
+        px[k] = (h[0] * cornerX[k] + h[1] * cornerY[k] + h[2]) / w;
+        py[k] = (h[3] * cornerX[k] + h[4] * cornerY[k] + h[5]) / w;
+    }
+    double area = 0;
+    for (int k = 0; k < 4; k++) {
+        int next = (k + 1) % 4;
+        int after = (k + 2) % 4;
+        double cross = (px[next] - px[k]) * (py[after] - py[next]) - (py[next] - py[k]) * (px[after] - px[next]);
+        if (cross <= 0) {
+            printf("Rejected homography: projected outline is not convex\n");
+            return false;
+        }
+        area += px[k] * py[next] - px[next] * py[k];
+    }
+
+    double areaRatio = area / 2 / ((double)size1.width * size1.height);
+    if (areaRatio > MAX_AREA_RATIO || areaRatio < 1 / MAX_AREA_RATIO) {
+        printf("Rejected homography: projected area is %.2fx the original\n", areaRatio);
+        return false;
+    }
+    return true;
+}
+
+//Returns the features of imgs[index] at the given SURF threshold and pyramid level, only running SURF on a cache miss
+//Safe to call from several threads as long as they ask for different images, or only hit the cache
+FeatureSet& getFeatures(const vector<Mat>& imgs, int index, double threshold, int level, bool withDescriptors) {
+    FeatureKey key = FeatureKey(threshold, level);
+    std::map<FeatureKey, FeatureSet>::iterator it = featureCache[index].find(key);
+    if (it != featureCache[index].end() && (!withDescriptors || it->second.descriptorsComputed)) {
+        #pragma omp atomic
+        featureCacheHits++;
+        return it->second;
+    }
+    #pragma omp atomic
+    featureCacheMisses++;
+
+    ScopedStage stage("extract");
+    stage.set("image", index);
+    FeatureSet& features = featureCache[index][key];
+    if (loadStoredFeatures(index, threshold, level, withDescriptors, features)) {
+        printf("Loaded %d keypoints of image %d from the feature store\n", (int)features.keypoints.size(), index);
+        stage.set("stored", 1);
+        stage.set("keypoints", features.keypoints.size());
+        return features;
+    }
+    const Mat& img = pyramidImage(imgs, index, level);
+    SURF surf_extractor(threshold);
+    if (binaryPipeline) {
+        //Higher SURF thresholds mean fewer, stronger keypoints, so the ranking phase gets fewer corners too
+        int maxFeatures = (threshold >= MATCH_SURF_THRESHOLD) ? BINARY_MATCH_FEATURES : BINARY_STITCH_FEATURES;
+        GridAdaptedFeatureDetector detector(new FastFeatureDetector(FAST_THRESHOLD, true), maxFeatures, BINARY_GRID_SIZE, BINARY_GRID_SIZE);
+        BriefDescriptorExtractor brief(BRIEF_BYTES);
+        detector.detect(img, features.keypoints);
+        //compute() drops keypoints too close to the border, so keypoints and descriptor rows stay in step
+        brief.compute(img, features.keypoints, features.descriptors);
+        features.descriptorsComputed = true;
+        printf("Extracted %d FAST corners with BRIEF descriptors from image %d\n", (int)features.keypoints.size(), index);
+    } else if (withDescriptors) {
+        //Reuse the cached keypoints if we have them and only compute the descriptors
+        bool haveKeypoints = (it != featureCache[index].end());
+        vector<float> descriptorValues;
+        surf_extractor(img, Mat(), features.keypoints, descriptorValues, haveKeypoints);
+        int descriptorSize = 0;
+        if (!features.keypoints.empty()) {
+            descriptorSize = (int)(descriptorValues.size() / features.keypoints.size());
+            features.descriptors = Mat(descriptorValues).reshape(1, (int)features.keypoints.size()).clone();
+        }
+        features.descriptorsComputed = true;
+        printf("Extracted %d keypoints and %d-float descriptors from image %d\n", (int)features.keypoints.size(), descriptorSize, index);
+    } else {
+        surf_extractor(img, Mat(), features.keypoints);
+        printf("Extracted %d keypoints from image %d\n", (int)features.keypoints.size(), index);
+    }
+    stage.set("keypoints", features.keypoints.size());
+    storeFeatures(index, threshold, level, features);
+    return features;
+}
+
+//Matches features1 (query) against features2 (train) with whichever pipeline was selected
+void matchFeatures(const Mat& img1, FeatureSet& features1, const Mat& img2, FeatureSet& features2, Ptr<GenericDescriptorMatcher> descriptorMatcher, vector<DMatch>& matches1to2) {
+    if (binaryPipeline) {
+        hammingMatch(features1.descriptors, features2.descriptors, matches1to2);
+    } else if (!features2.model.empty()) {
+        //Same result as the call below, minus training on img2 again
+        features2.model->match(img1, features1.keypoints, matches1to2);
+    } else {
+        descriptorMatcher->match(img1, features1.keypoints, img2, features2.keypoints, matches1to2);
+    }
+}
+
+//Number of differing bits between two descriptors of the given length in bytes, 8 bytes at a time
+static inline int hammingDistance(const uchar* a, const uchar* b, int bytes) {
+    int distance = 0;
+    int k = 0;
+    for (; k + 8 <= bytes; k += 8) {
+        unsigned long long wordA, wordB;
+        memcpy(&wordA, a + k, 8);
+        memcpy(&wordB, b + k, 8);
+        distance += __builtin_popcountll(wordA ^ wordB);
+    }
+    for (; k < bytes; k++) {
+        distance += __builtin_popcount(a[k] ^ b[k]);
+    }
+    return distance;
+}
+
+//Brute force matching of binary descriptors. A query keeps its nearest train descriptor only if it is clearly better
+//than the second nearest (Lowe ratio test) and the query is also that train descriptor's nearest (cross check).
+//Both directions come out of the one pass over the distance matrix
+void hammingMatch(const Mat& queryDescriptors, const Mat& trainDescriptors, vector<DMatch>& matches) {
+    matches.clear();
+    if (queryDescriptors.empty() || trainDescriptors.empty()) {
+        return;
+    }
+    int bytes = queryDescriptors.cols;
+    int queryCount = queryDescriptors.rows;
+    int trainCount = trainDescriptors.rows;
+
+    vector<int> best(queryCount, INT_MAX), secondBest(queryCount, INT_MAX), bestTrain(queryCount, -1);
+    vector<int> trainBest(trainCount, INT_MAX), trainBestQuery(trainCount, -1);
+    for (int q = 0; q < queryCount; q++) {
+        const uchar* query = queryDescriptors.ptr(q);
+        for (int t = 0; t < trainCount; t++) {
+            int distance = hammingDistance(query, trainDescriptors.ptr(t), bytes);
+            if (distance < best[q]) {
+                secondBest[q] = best[q];
+                best[q] = distance;
+                bestTrain[q] = t;
+            } else if (distance < secondBest[q]) {
+                secondBest[q] = distance;
+            }
+            if (distance < trainBest[t]) {
+                trainBest[t] = distance;
+                trainBestQuery[t] = q;
+            }
+        }
+    }
+
+    for (int q = 0; q < queryCount; q++) {
+        int t = bestTrain[q];
+        if (t < 0 || trainBestQuery[t] != q) {continue;}
+        if (secondBest[q] != INT_MAX && best[q] >= HAMMING_RATIO * secondBest[q]) {continue;}
+        matches.push_back(DMatch(q, t, (float)best[q]));
+    }
+}
+
+//Buckets keypoints into square cells so the ones near a point can be listed without looking at all of them
+struct KeypointGrid {
+    float cellSize;
+    float originX, originY;
+    int cols, rows;
+    vector<vector<int> > cells;
+
+    KeypointGrid(const vector<KeyPoint>& keypoints, float cellSize_) : cellSize(cellSize_), originX(0), originY(0), cols(0), rows(0) {
+        if (keypoints.empty()) {return;}
+        float maxX = keypoints[0].pt.x, maxY = keypoints[0].pt.y;
+        originX = maxX;
+        originY = maxY;
+        for (int k = 1; k < keypoints.size(); k++) {
+            originX = std::min(originX, keypoints[k].pt.x);
+            originY = std::min(originY, keypoints[k].pt.y);
+            maxX = std::max(maxX, keypoints[k].pt.x);
+            maxY = std::max(maxY, keypoints[k].pt.y);
+        }
+        cols = (int)((maxX - originX) / cellSize) + 1;
+        rows = (int)((maxY - originY) / cellSize) + 1;
+        cells.resize(cols * rows);
+        for (int k = 0; k < keypoints.size(); k++) {
+            int c = (int)((keypoints[k].pt.x - originX) / cellSize);
+            int r = (int)((keypoints[k].pt.y - originY) / cellSize);
+            cells[r * cols + c].push_back(k);
+        }
+    }
+
+    //Indices of the keypoints whose cells overlap the square of half size radius around p. Callers check the exact window
+    void near(Point2f p, float radius, vector<int>& found) const {
+        found.clear();
+        int c0 = std::max(0, cvFloor((p.x - radius - originX) / cellSize));
+        int c1 = std::min(cols - 1, cvFloor((p.x + radius - originX) / cellSize));
+        int r0 = std::max(0, cvFloor((p.y - radius - originY) / cellSize));
+        int r1 = std::min(rows - 1, cvFloor((p.y + radius - originY) / cellSize));
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) {
+                found.insert(found.end(), cells[r * cols + c].begin(), cells[r * cols + c].end());
+            }
+        }
+    }
+};
+
+//Distance between row q of queryDescriptors and row t of trainDescriptors: Hamming for binary descriptors, L2 for float
+static inline float descriptorDistance(const Mat& queryDescriptors, int q, const Mat& trainDescriptors, int t) {
+    if (queryDescriptors.depth() == CV_8U) {
+        return (float)hammingDistance(queryDescriptors.ptr(q), trainDescriptors.ptr(t), queryDescriptors.cols);
+    }
+    const float* a = queryDescriptors.ptr<float>(q);
+    const float* b = trainDescriptors.ptr<float>(t);
+    float sum = 0;
+    for (int k = 0; k < queryDescriptors.cols; k++) {
+        float d = a[k] - b[k];
+        sum += d * d;
+    }
+    return sqrt(sum);
+}
+
+//Like windowedMatchingMask and a brute force match in samples/video_homography.cpp, without building the mask: each
+//query keypoint is moved by H (query image to train image) and only compared with the train keypoints within radius
+//of where it lands, found through a grid of cells one radius wide. That is O(queries * neighbours) instead of
+//O(queries * trains). The ratio test and cross check of hammingMatch are then applied within those windows
+void guidedMatch(const vector<KeyPoint>& queryKeypoints, const Mat& queryDescriptors, const vector<KeyPoint>& trainKeypoints, const Mat& trainDescriptors, const Mat& H, float radius, vector<DMatch>& matches) {
+    matches.clear();
+    if (queryKeypoints.empty() || trainKeypoints.empty() || queryDescriptors.empty() || trainDescriptors.empty()) {
+        return;
+    }
+    double ratio = (queryDescriptors.depth() == CV_8U) ? HAMMING_RATIO : MATCH_RATIO;
+
+    vector<Point2f> positions(queryKeypoints.size()), predicted(queryKeypoints.size());
+    for (int q = 0; q < queryKeypoints.size(); q++) {positions[q] = queryKeypoints[q].pt;}
+    Mat predictedMat(predicted);
+    perspectiveTransform(Mat(positions), predictedMat, H);
+
+    KeypointGrid grid(trainKeypoints, radius);
+    int trainCount = trainKeypoints.size();
+    vector<float> trainBest(trainCount, FLT_MAX);
+    vector<int> trainBestQuery(trainCount, -1);
+    vector<DMatch> candidates;
+    vector<int> nearby;
+    for (int q = 0; q < queryKeypoints.size(); q++) {
+        grid.near(predicted[q], radius, nearby);
+        float best = FLT_MAX, secondBest = FLT_MAX;
+        int bestTrain = -1;
+        for (int n = 0; n < nearby.size(); n++) {
+            int t = nearby[n];
+            Point2f offset = trainKeypoints[t].pt - predicted[q];
+            if (fabs(offset.x) > radius || fabs(offset.y) > radius) {continue;}
+            float distance = descriptorDistance(queryDescriptors, q, trainDescriptors, t);
+            if (distance < best) {
+                secondBest = best;
+                best = distance;
+                bestTrain = t;
+            } else if (distance < secondBest) {
+                secondBest = distance;
+            }
+            if (distance < trainBest[t]) {
+                trainBest[t] = distance;
+                trainBestQuery[t] = q;
+            }
+        }
+        if (bestTrain < 0) {continue;}
+        if (secondBest != FLT_MAX && best >= ratio * secondBest) {continue;}
+        candidates.push_back(DMatch(q, bestTrain, best));
+    }
+    for (int c = 0; c < candidates.size(); c++) {
+        if (trainBestQuery[candidates[c].trainIdx] == candidates[c].queryIdx) {matches.push_back(candidates[c]);}
+    }
+    std::stable_sort(matches.begin(), matches.end());
+}
+
+//Full resolution homography from the dense stitching features of both images, matched with guidedMatch around where
+//coarseH puts them. Returns an empty Mat if too few matches survive, the caller then keeps or refines coarseH
+//The features must have been extracted with descriptors already when called from several threads
+Mat guidedHomography(const vector<Mat>& imgs, int index1, int index2, const Mat& coarseH, float radius, vector<Point2f>& points1, vector<Point2f>& points2, vector<uchar>& inlierMask) {
+    const FeatureSet& features1 = getFeatures(imgs, index1, STITCH_SURF_THRESHOLD, 0, true);
+    const FeatureSet& features2 = getFeatures(imgs, index2, STITCH_SURF_THRESHOLD, 0, true);
+    vector<DMatch> matches;
+    guidedMatch(features1.keypoints, features1.descriptors, features2.keypoints, features2.descriptors, coarseH, radius, matches);
+
+    points1.clear();
+    points2.clear();
+    for (int q = 0; q < matches.size(); q++) {
+        points1.push_back(features1.keypoints[matches[q].queryIdx].pt);
+        points2.push_back(features2.keypoints[matches[q].trainIdx].pt);
+    }
+    Mat H = robustHomography(points1, points2, REFINE_RANSAC_THRESHOLD, inlierMask);
+    int inliers = H.empty() ? 0 : countNonZero(Mat(inlierMask));
+    printf("Guided matching: %d matches within %.0f px of the prediction, %d inliers\n", (int)matches.size(), radius, inliers);
+    if (inliers < 8) {
+        return Mat();
+    }
+    return H;
+}
+
+//Gives the cached features of imgs[index] a copy of descriptorMatcher trained on them, once
+//This is what GenericDescriptorMatcher::match(queryImg, ..., trainImg, ...) does internally on every call, so later
+//matches against the model give the same results. A trained model is only read while matching, so it can be shared
+//between threads. With --model-cache the FERN classifier is saved under modelPath and read back on later runs
+void trainModel(const vector<Mat>& imgs, int index, double threshold, int level, Ptr<GenericDescriptorMatcher> descriptorMatcher) {
+    if (binaryPipeline) {
+        return;
+    }
+    FeatureSet& features = getFeatures(imgs, index, threshold, level);
+    if (!features.model.empty()) {
+        return;
+    }
+
+    ScopedStage stage("train_model");
+    stage.set("image", index);
+    Ptr<GenericDescriptorMatcher> model = descriptorMatcher->clone(true);
+    //add() drops keypoints it can't use, swap them back so match indices line up with the cache
+    vector<vector<KeyPoint> > trainKeypoints(1, features.keypoints);
+    model->add(vector<Mat>(1, pyramidImage(imgs, index, level)), trainKeypoints);
+    features.keypoints.swap(trainKeypoints[0]);
+
+    //Only a CachedFernMatcher with --model-cache, see main. It still needs the keypoints added above to match
+    CachedFernMatcher* cached = dynamic_cast<CachedFernMatcher*>((GenericDescriptorMatcher*)model);
+    std::string path = cached != 0 ? modelPath(index, threshold, level) : std::string();
+    if (!path.empty()) {
+        FileStorage fs(path, FileStorage::READ);
+        if (fs.isOpened() && cached->readClassifier(fs.root())) {
+            #pragma omp atomic
+            modelsLoaded++;
+            features.model = model;
+            return;
+        }
+    }
+
+    seedPairRNG(index, index);
+    model->train();
+    #pragma omp atomic
+    modelsTrained++;
+
+    if (!path.empty()) {
+        //Through a rename, so another batch job sharing the model never reads half of it. The temporary keeps the
+        //extension, FileStorage picks the format from it
+        std::string temporary = temporaryPath(path) + ".yml";
+        FileStorage fs(temporary, FileStorage::WRITE);
+        if (fs.isOpened()) {
+            cached->write(fs);
+            fs.release();
+            if (rename(temporary.c_str(), path.c_str()) != 0) {
+                remove(temporary.c_str());
+            }
+        }
+    }
+    features.model = model;
+}
+
+//64 bit FNV-1a of size bytes, continuing from hash
+static unsigned long long fnv1a(const void* data, size_t size, unsigned long long hash = 14695981039346656037ULL) {
+    const uchar* bytes = (const uchar*)data;
+    for (size_t k = 0; k < size; k++) {
+        hash ^= bytes[k];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+//Read only mapping of a whole file, or 0 if it can't be mapped
+static const uchar* mapFile(const std::string& path, size_t& size) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {return 0;}
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        size = info.st_size;
+        data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    return data == MAP_FAILED ? 0 : (const uchar*)data;
+}
+
+//FNV-1a of a file's content, 0 if it can't be read. Hashes through a mapping instead of reading into a buffer
+unsigned long long fileHash(const std::string& path) {
+    size_t size;
+    const uchar* data = mapFile(path, size);
+    if (data == 0) {return 0;}
+    unsigned long long hash = fnv1a(data, size);
+    munmap((void*)data, size);
+    return hash;
+}
+
+//Only input frames can be stored, a stitched mosaic has no file to hash
+static bool storeEnabled(int index) {
+    return !featureStore.empty() && index < imageHashes.size() && imageHashes[index] != 0 && !imagePaths[index].empty();
+}
+
+//Hashes in everything besides the frames that stored results depend on
+static unsigned long long storeParameters(unsigned long long hash) {
+    int values[6] = {FEATURE_STORE_VERSION, binaryPipeline, inputsProjected ? projectionMode : PROJECTION_PLANE, pyramidLevels, guidedMatching, rankByInliers};
+    double focal = inputsProjected ? focalLength : 0;
+    hash = fnv1a(values, sizeof(values), hash);
+    hash = fnv1a(&focal, sizeof(focal), hash);
+    hash = fnv1a(&matcherParamsHash, sizeof(matcherParamsHash), hash);
+    return fnv1a(matcherName.data(), matcherName.size(), hash);
+}
+
+static std::string storePath(unsigned long long key, const char* extension) {
+    char name[64];
+    sprintf(name, "/%016llx.%s", key, extension);
+    return featureStore + name;
+}
+
+//Where the trained model for imgs[index] is saved, keyed like the store by file content and parameters (including
+//the matcher's parameter file, see storeParameters). It goes in the feature store if there is one, in modelDirectory
+//for a batch and with the outputs otherwise, never next to the inputs. Empty for stitched mosaics and frames that
+//couldn't be hashed
+std::string modelPath(int index, double threshold, int level) {
+    if (imagePaths[index].empty() || index >= imageHashes.size() || imageHashes[index] == 0) {
+        return std::string();
+    }
+    unsigned long long hash = fnv1a(&imageHashes[index], sizeof(imageHashes[index]));
+    hash = fnv1a(&threshold, sizeof(threshold), hash);
+    hash = storeParameters(fnv1a(&level, sizeof(level), hash));
+    if (!featureStore.empty()) {
+        return storePath(hash, "model.yml");
+    }
+    char name[64];
+    sprintf(name, "model-%016llx.yml", hash);
+    return modelDirectory.empty() ? outputPath(name) : modelDirectory + name;
+}
+
+//A name next to path that no other thread or process writes to, for a file that is then renamed to path
+std::string temporaryPath(const std::string& path) {
+    char suffix[64];
+#ifdef _OPENMP
+    sprintf(suffix, ".tmp%d.%d", (int)getpid(), omp_get_thread_num());
+#else
+    static int temporaries = 0;
+    sprintf(suffix, ".tmp%d.%d", (int)getpid(), __sync_fetch_and_add(&temporaries, 1));
+#endif
+    return path + suffix;
+}
+
+//Writes bytes to path through a temporary file and a rename, so a reader (or another batch job) never maps half a file
+static bool writeStoreFile(const std::string& path, const vector<uchar>& bytes) {
+    std::string temporary = temporaryPath(path);
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == 0) {return false;}
+    bool written = fwrite(&bytes[0], 1, bytes.size(), file) == bytes.size();
+    written = (fclose(file) == 0) && written;
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+static size_t alignStore(size_t offset) {
+    return (offset + 63) & ~(size_t)63;
+}
+
+//A .feat file is this header, then header.keypoints StoredKeypoints at keypointOffset, then the descriptor rows back
+//to back at descriptorOffset. Both offsets are multiples of 64, so descriptors can be used in place from a mapping
+struct FeatureFileHeader {
+    char magic[8];  //"PGFEAT1"
+    int keypoints;
+    int descriptorRows;  //0 if the features were saved without descriptors
+    int descriptorCols;
+    int descriptorType;
+    long long descriptorRowBytes;
+    long long keypointOffset;
+    long long descriptorOffset;
+};
+struct StoredKeypoint {
+    float x, y, size, angle, response;
+    int octave, classId;
+};
+const char FEATURE_MAGIC[8] = "PGFEAT1";
+
+//A .pair file is this header, then the correspondences: points1, points2 (two floats each) and the inlier mask
+struct PairFileHeader {
+    char magic[8];  //"PGPAIR1"
+    int hasHomography;
+    int correspondences;
+    double score;
+    double H[9];
+};
+const char PAIR_MAGIC[8] = "PGPAIR1";
+
+static unsigned long long featureStoreKey(int index, double threshold, int level) {
+    unsigned long long hash = fnv1a(&imageHashes[index], sizeof(imageHashes[index]));
+    hash = fnv1a(&threshold, sizeof(threshold), hash);
+    hash = fnv1a(&level, sizeof(level), hash);
+    return storeParameters(hash);
+}
+
+//Fills features from the store if it has them (with descriptors, if asked for). Keypoints are copied out, but the
+//descriptors stay in the file's mapping, which features.mapping unmaps once the cache entry is dropped. The kernel
+//pages them in as the matcher reads them, and can drop them again without writing anything back
+bool loadStoredFeatures(int index, double threshold, int level, bool withDescriptors, FeatureSet& features) {
+    if (!storeEnabled(index)) {return false;}
+    size_t size;
+    const uchar* data = mapFile(storePath(featureStoreKey(index, threshold, level), "feat"), size);
+    if (data == 0) {return false;}
+    const FeatureFileHeader* header = (const FeatureFileHeader*)data;
+    bool valid = size >= sizeof(FeatureFileHeader) && memcmp(header->magic, FEATURE_MAGIC, 8) == 0 &&
+                 header->keypointOffset + (long long)header->keypoints * sizeof(StoredKeypoint) <= (long long)size &&
+                 header->descriptorOffset + header->descriptorRows * header->descriptorRowBytes <= (long long)size;
+    bool hasDescriptors = valid && header->descriptorRows > 0;
+    if (!valid || (withDescriptors && !hasDescriptors)) {
+        munmap((void*)data, size);
+        return false;
+    }
+
+    const StoredKeypoint* stored = (const StoredKeypoint*)(data + header->keypointOffset);
+    features.keypoints.resize(header->keypoints);
+    for (int k = 0; k < header->keypoints; k++) {
+        features.keypoints[k] = KeyPoint(Point2f(stored[k].x, stored[k].y), stored[k].size, stored[k].angle, stored[k].response, stored[k].octave, stored[k].classId);
+    }
+    if (hasDescriptors) {
+        features.descriptors = Mat(header->descriptorRows, header->descriptorCols, header->descriptorType, (void*)(data + header->descriptorOffset), (size_t)header->descriptorRowBytes);
+        features.descriptorsComputed = true;
+        features.mapping = new StoreMapping(data, size);
+    } else {
+        features.descriptors = Mat();
+        features.descriptorsComputed = false;
+        features.mapping.release();
+        munmap((void*)data, size);
+    }
+    #pragma omp atomic
+    storedFeaturesLoaded++;
+    return true;
+}
+
+void storeFeatures(int index, double threshold, int level, const FeatureSet& features) {
+    if (!storeEnabled(index)) {return;}
+    Mat descriptors = features.descriptors.isContinuous() ? features.descriptors : features.descriptors.clone();
+    FeatureFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FEATURE_MAGIC, 8);
+    header.keypoints = features.keypoints.size();
+    header.descriptorRows = descriptors.rows;
+    header.descriptorCols = descriptors.cols;
+    header.descriptorType = descriptors.type();
+    header.descriptorRowBytes = descriptors.cols * descriptors.elemSize();
+    header.keypointOffset = alignStore(sizeof(header));
+    header.descriptorOffset = alignStore(header.keypointOffset + header.keypoints * sizeof(StoredKeypoint));
+
+    vector<uchar> bytes(header.descriptorOffset + header.descriptorRows * header.descriptorRowBytes, 0);
+    memcpy(&bytes[0], &header, sizeof(header));
+    StoredKeypoint* stored = (StoredKeypoint*)&bytes[header.keypointOffset];
+    for (int k = 0; k < header.keypoints; k++) {
+        const KeyPoint& keypoint = features.keypoints[k];
+        StoredKeypoint record = {keypoint.pt.x, keypoint.pt.y, keypoint.size, keypoint.angle, keypoint.response, keypoint.octave, keypoint.class_id};
+        stored[k] = record;
+    }
+    if (header.descriptorRows > 0) {
+        memcpy(&bytes[header.descriptorOffset], descriptors.data, header.descriptorRows * header.descriptorRowBytes);
+    }
+    if (writeStoreFile(storePath(featureStoreKey(index, threshold, level), "feat"), bytes)) {
+        #pragma omp atomic
+        storedFeaturesSaved++;
+    }
+}
+
+static unsigned long long pairStoreKey(int index1, int index2, int kind) {
+    unsigned long long hash = fnv1a(&imageHashes[index1], sizeof(imageHashes[index1]));
+    hash = fnv1a(&imageHashes[index2], sizeof(imageHashes[index2]), hash);
+    hash = fnv1a(&kind, sizeof(kind), hash);
+    return storeParameters(hash);
+}
+
+//A stored findBestMatch score (kind PAIR_SCORE) or estimateHomography result (PAIR_HOMOGRAPHY) for two input frames
+//H is left empty if the stored estimate found no homography
+bool loadPairResult(int index1, int index2, int kind, float& score, Mat& H, vector<Point2f>& points1, vector<Point2f>& points2, vector<uchar>& inlierMask) {
+    if (!storeEnabled(index1) || !storeEnabled(index2)) {return false;}
+    size_t size;
+    const uchar* data = mapFile(storePath(pairStoreKey(index1, index2, kind), "pair"), size);
+    if (data == 0) {return false;}
+    const PairFileHeader* header = (const PairFileHeader*)data;
+    int n = (size >= sizeof(PairFileHeader)) ? header->correspondences : 0;
+    bool valid = size >= sizeof(PairFileHeader) && memcmp(header->magic, PAIR_MAGIC, 8) == 0 && n >= 0 &&
+                 sizeof(PairFileHeader) + n * (2 * sizeof(Point2f) + 1) <= size;
+    if (valid) {
+        score = (float)header->score;
+        H = header->hasHomography ? Mat(3, 3, CV_64F, (void*)header->H).clone() : Mat();
+        const Point2f* points = (const Point2f*)(data + sizeof(PairFileHeader));
+        points1.assign(points, points + n);
+        points2.assign(points + n, points + 2 * n);
+        const uchar* mask = (const uchar*)(points + 2 * n);
+        inlierMask.assign(mask, mask + n);
+        #pragma omp atomic
+        storedPairsLoaded++;
+    }
+    munmap((void*)data, size);
+    return valid;
+}
+
+void storePairResult(int index1, int index2, int kind, float score, const Mat& H, const vector<Point2f>& points1, const vector<Point2f>& points2, const vector<uchar>& inlierMask) {
+    if (!storeEnabled(index1) || !storeEnabled(index2)) {return;}
+    PairFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PAIR_MAGIC, 8);
+    header.hasHomography = !H.empty();
+    header.correspondences = points1.size();
+    header.score = score;
+    if (!H.empty()) {
+        Mat H64;
+        H.convertTo(H64, CV_64F);
+        memcpy(header.H, H64.ptr<double>(0), sizeof(header.H));
+    }
+    int n = header.correspondences;
+    vector<uchar> bytes(sizeof(header) + n * (2 * sizeof(Point2f) + 1));
+    memcpy(&bytes[0], &header, sizeof(header));
+    if (n > 0) {
+        memcpy(&bytes[sizeof(header)], &points1[0], n * sizeof(Point2f));
+        memcpy(&bytes[sizeof(header) + n * sizeof(Point2f)], &points2[0], n * sizeof(Point2f));
+        memcpy(&bytes[sizeof(header) + 2 * n * sizeof(Point2f)], &inlierMask[0], n);
+    }
+    if (writeStoreFile(storePath(pairStoreKey(index1, index2, kind), "pair"), bytes)) {
+        #pragma omp atomic
+        storedPairsSaved++;
+    }
+}
+
+//imgs[index] halved level times, level 0 is the image itself. Levels are built once and kept until invalidated
+const Mat& pyramidImage(const vector<Mat>& imgs, int index, int level) {
+    if (level == 0) {
+        return imgs[index];
+    }
+    vector<Mat>& levels = pyramidCache[index];
+    if (levels.empty()) {
+        levels.push_back(imgs[index]);
+    }
+    while (levels.size() <= level) {
+        Mat down;
+        pyrDown(levels.back(), down);
+        levels.push_back(down);
+    }
+    return levels[level];
+}
+
+//Decodes every file once, in parallel, and derives the gray plane from the colour one
+//With --pyramid the matching level is built here too, while the image is hot in cache
+//With --mem-budget a frame's colour data is only kept while the frames kept so far fit in the budget, so at most one
+//frame per thread is resident beyond it, even while loading
+void loadImages(const vector<std::string>& paths, vector<Mat>& imgs, vector<Mat>& imgs_rgb) {
+    int64 start = getTickCount();
+    int n = paths.size();
+    imgs.assign(n, Mat());
+    imgs_rgb.assign(n, Mat());
+    imagePaths = paths;
+    imageHashes.assign(n, 0);
+    if ((!featureStore.empty() || modelCacheOnDisk) && !matcherParamsPath.empty()) {
+        matcherParamsHash = fileHash(matcherParamsPath);
+    }
+
+    printf("Reading images...\n");
+    size_t colorBytes = 0;
+    size_t resident = 0;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < n; i++) {
+        if (!featureStore.empty() || modelCacheOnDisk) {
+            imageHashes[i] = fileHash(paths[i]);
+        }
+        imgs_rgb[i] = imread(paths[i].c_str(), 1);
+        if (imgs_rgb[i].empty()) {continue;}
+        //imread gives BGR, this matches what imread(..., 0) produced
+        cvtColor(imgs_rgb[i], imgs[i], CV_BGR2GRAY);
+        if (pyramidLevels > 0) {
+            pyramidImage(imgs, i, pyramidLevels);
+        }
+        size_t bytes = imgs_rgb[i].total() * imgs_rgb[i].elemSize();
+        __sync_fetch_and_add(&colorBytes, bytes);
+        if (memoryBudget > 0 && __sync_add_and_fetch(&resident, bytes) > memoryBudget) {
+            //colorImage decodes it again when it is needed
+            __sync_fetch_and_sub(&resident, bytes);
+            imgs_rgb[i].release();
+        }
+    }
+
+    printf("Read %d images in %.1f ms, %.1f MB of colour data\n", n, (getTickCount() - start) * 1000.0 / getTickFrequency(), colorBytes / (1024.0 * 1024.0));
+    if (memoryBudget > 0) {
+        printf("Colour data resident: %.1f MB (budget %.1f MB)\n", resident / (1024.0 * 1024.0), memoryBudget / (1024.0 * 1024.0));
+    }
+}
+
+//imgs_rgb[index], decoding it again first if enforceMemoryBudget dropped it
+const Mat& colorImage(vector<Mat>& imgs_rgb, int index) {
+    if (imgs_rgb[index].empty() && !imagePaths[index].empty()) {
+        printf("Decoding %s again\n", imagePaths[index].c_str());
+        imgs_rgb[index] = imread(imagePaths[index].c_str(), 1);
+        if (inputsProjected && !imgs_rgb[index].empty()) {
+            imgs_rgb[index] = projectImage(imgs_rgb[index]);
+        }
+    }
+    return imgs_rgb[index];
+}
+
+//Drops the colour data of input frames (never stitched mosaics, they can't be decoded again) until what is left
+//fits in memoryBudget. Anyone still holding a Mat of a dropped frame keeps it alive, so this is always safe to call
+void enforceMemoryBudget(vector<Mat>& imgs_rgb) {
+    if (memoryBudget == 0) {
+        return;
+    }
+    size_t resident = 0;
+    for (int i = 0; i < imgs_rgb.size(); i++) {
+        resident += imgs_rgb[i].total() * imgs_rgb[i].elemSize();
+    }
+    for (int i = 0; i < imgs_rgb.size() && resident > memoryBudget; i++) {
+        if (imgs_rgb[i].empty() || imagePaths[i].empty()) {continue;}
+        resident -= imgs_rgb[i].total() * imgs_rgb[i].elemSize();
+        imgs_rgb[i].release();
+    }
+    printf("Colour data resident: %.1f MB (budget %.1f MB)\n", resident / (1024.0 * 1024.0), memoryBudget / (1024.0 * 1024.0));
+}
+
+//Drops everything cached for imgs[index], called once that image has been replaced by a stitched one
+//Descriptors mapped from the feature store are unmapped here, unless a copy of their FeatureSet is still in use
+void invalidateFeatures(int index) {
+    featureCache[index].clear();
+    pyramidCache[index].clear();
+    retrievalHistograms[index].release();
+}
+
+//FAST corners and BRIEF descriptors for estimateFocal. They stay out of the feature cache, everything computed from
+//the unprojected frames is thrown away by projectInputs anyway
+static void focalFeatures(const Mat& img, vector<KeyPoint>& keypoints, Mat& descriptors) {
+    GridAdaptedFeatureDetector detector(new FastFeatureDetector(FAST_THRESHOLD, true), BINARY_STITCH_FEATURES, BINARY_GRID_SIZE, BINARY_GRID_SIZE);
+    BriefDescriptorExtractor brief(BRIEF_BYTES);
+    detector.detect(img, keypoints);
+    brief.compute(img, keypoints, descriptors);
+}
+
+//Focal length from the homographies of a few neighbouring pairs, the median of the per pair estimates. Neighbours are
+//the --retrieval candidates if there are any, and consecutive frames otherwise, so no pair ranking has to run on
+//frames that are about to be projected. The pairs are matched with the binary pipeline whatever the matcher, so no
+//model gets trained on frames that are thrown away. Falls back to the frame width (about a 53 degree field of view)
+//if no pair gives an estimate
+double estimateFocal(const vector<Mat>& imgs) {
+    ScopedStage stage("estimate_focal");
+    printf("Estimating the focal length...\n");
+    int n = imgs.size();
+    vector<Point> pairs;
+    if (retrievalNeighbours > 0) {
+        Mat keep = retrievalCandidates(imgs);
+        for (int i = 0; i < n; i++) {
+            for (int j = i + 1; j < n; j++) {
+                if (keep.at<uchar>(i, j)) {pairs.push_back(Point(i, j));}
+            }
+        }
+    } else {
+        for (int i = 0; i + 1 < n; i++) {
+            pairs.push_back(Point(i, i + 1));
+        }
+    }
+
+    //Pairs are tried spread over the whole set until FOCAL_PAIRS of them gave an estimate. Twice that many are
+    //considered, and only their frames get features
+    int step = std::max(1, (int)pairs.size() / FOCAL_PAIRS);
+    vector<Point> ordered;
+    for (int start = 0; start < step; start++) {
+        for (int p = start; p < (int)pairs.size(); p += step) {ordered.push_back(pairs[p]);}
+    }
+    ordered.resize(std::min((int)ordered.size(), 2 * FOCAL_PAIRS));
+    pairs.swap(ordered);
+    vector<int> needed;
+    for (int p = 0; p < pairs.size(); p++) {
+        needed.push_back(pairs[p].x);
+        needed.push_back(pairs[p].y);
+    }
+    std::sort(needed.begin(), needed.end());
+    needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+    vector<vector<KeyPoint> > keypoints(n);
+    vector<Mat> descriptors(n);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int k = 0; k < (int)needed.size(); k++) {
+        if (!imgs[needed[k]].empty()) {
+            focalFeatures(imgs[needed[k]], keypoints[needed[k]], descriptors[needed[k]]);
+        }
+    }
+
+    vector<double> focals;
+    for (int p = 0; p < pairs.size() && focals.size() < FOCAL_PAIRS; p++) {
+        int i = pairs[p].x;
+        int j = pairs[p].y;
+        if (descriptors[i].empty() || descriptors[j].empty()) {continue;}
+        vector<DMatch> matches;
+        hammingMatch(descriptors[i], descriptors[j], matches);
+        vector<Point2f> points1, points2;
+        for (int q = 0; q < matches.size(); q++) {
+            points1.push_back(keypoints[i][matches[q].queryIdx].pt);
+            points2.push_back(keypoints[j][matches[q].trainIdx].pt);
+        }
+        seedPairRNG(i, j);
+        vector<uchar> inlierMask;
+        Mat H = robustHomography(points1, points2, RANSAC_THRESHOLD, inlierMask);
+        double focal;
+        if (!H.empty() && validateHomography(H, inlierMask, imgs[pairs[p].x].size()) &&
+            focalFromHomography(H, imgs[pairs[p].x].size(), imgs[pairs[p].y].size(), focal)) {
+            printf("Pair %d-%d: focal length %.1f\n", pairs[p].x, pairs[p].y, focal);
+            focals.push_back(focal);
+        }
+    }
+    stage.set("estimates", focals.size());
+    if (focals.empty()) {
+        printf("No homography gave a focal length, using the frame width %d\n", imgs[0].cols);
+        return imgs[0].cols;
+    }
+    std::nth_element(focals.begin(), focals.begin() + focals.size() / 2, focals.end());
+    double focal = focals[focals.size() / 2];
+    printf("Focal length %.1f, the median of %d estimates\n", focal, (int)focals.size());
+    stage.set("focal", focal);
+    return focal;
+}
+
+//Focal length of a camera that only rotated between two frames, from the homography taking the first to the second
+//(Szeliski and Shum, "Creating Full View Panoramic Image Mosaics and Environment Maps"). Each frame gets its own
+//estimate from the constraint that the rotation's rows (or columns) are orthogonal and of equal length
+//Returns false if either estimate is missing, as it is when the motion is closer to a translation
+bool focalFromHomography(const Mat& H, Size size1, Size size2, double& focal) {
+    //The constraints assume the principal point is at the origin of both frames
+    Mat centred = translation(-size2.width / 2.0, -size2.height / 2.0) * H * translation(size1.width / 2.0, size1.height / 2.0);
+    const double* h = centred.ptr<double>(0);
+
+    double d1 = h[6] * h[7];
+    double d2 = (h[7] - h[6]) * (h[7] + h[6]);
+    double v1 = -(h[0] * h[1] + h[3] * h[4]) / d1;
+    double v2 = (h[0] * h[0] + h[3] * h[3] - h[1] * h[1] - h[4] * h[4]) / d2;
+    if (v1 < v2) {std::swap(v1, v2);}
+    double focal1;
+    if (v1 > 0 && v2 > 0) {focal1 = sqrt(fabs(d1) > fabs(d2) ? v1 : v2);}
+    else if (v1 > 0) {focal1 = sqrt(v1);}
+    else {return false;}
+
+    d1 = h[0] * h[3] + h[1] * h[4];
+    d2 = h[0] * h[0] + h[1] * h[1] - h[3] * h[3] - h[4] * h[4];
+    v1 = -h[2] * h[5] / d1;
+    v2 = (h[5] * h[5] - h[2] * h[2]) / d2;
+    if (v1 < v2) {std::swap(v1, v2);}
+    double focal2;
+    if (v1 > 0 && v2 > 0) {focal2 = sqrt(fabs(d1) > fabs(d2) ? v1 : v2);}
+    else if (v1 > 0) {focal2 = sqrt(v1);}
+    else {return false;}
+
+    focal = sqrt(focal1 * focal2);
+    //A division by a (near) zero denominator above gives an infinite or meaningless estimate
+    return focal > 1 && focal < 100.0 * std::max(size1.width, size1.height);
+}
+
+//Remap tables from a projected frame back to the source pixels. Every frame of the same size shares one pair
+struct ProjectionMaps {
+    Mat mapX;
+    Mat mapY;
+};
+std::map<std::pair<int, int>, ProjectionMaps> projectionMaps;
+
+//The tables for frames of the given size, built by whichever thread asks first
+//The projected frame spans the frame's field of view at one pixel per 1/focalLength radians in the middle
+static const ProjectionMaps& projectionMapsFor(Size size) {
+    ProjectionMaps* maps;
+    #pragma omp critical(projection)
+    {
+        maps = &projectionMaps[std::make_pair(size.width, size.height)];
+        if (maps->mapX.empty()) {
+            double f = focalLength;
+            double cx = size.width / 2.0, cy = size.height / 2.0;
+            bool spherical = (projectionMode == PROJECTION_SPHERICAL);
+            int width = 2 * cvCeil(f * atan(cx / f));
+            int height = spherical ? 2 * cvCeil(f * atan(cy / f)) : size.height;
+            maps->mapX.create(height, width, CV_32F);
+            maps->mapY.create(height, width, CV_32F);
+            for (int v = 0; v < height; v++) {
+                float* mapX = maps->mapX.ptr<float>(v);
+                float* mapY = maps->mapY.ptr<float>(v);
+                for (int u = 0; u < width; u++) {
+                    double theta = (u - width / 2.0) / f;
+                    if (spherical) {
+                        //Ray through longitude theta and latitude phi, onto the frame plane at z = f
+                        double phi = (v - height / 2.0) / f;
+                        double z = cos(theta) * cos(phi);
+                        mapX[u] = (float)(f * sin(theta) * cos(phi) / z + cx);
+                        mapY[u] = (float)(f * sin(phi) / z + cy);
+                    } else {
+                        mapX[u] = (float)(f * tan(theta) + cx);
+                        mapY[u] = (float)((v - height / 2.0) / cos(theta) + cy);
+                    }
+                }
+            }
+            printf("Built %s projection tables for %d x %d frames: %d x %d\n", spherical ? "spherical" : "cylindrical", size.width, size.height, width, height);
+        }
+    }
+    return *maps;
+}
+
+//image projected onto the surface selected by --projection, with black where no source pixel lands
+Mat projectImage(const Mat& image) {
+    const ProjectionMaps& maps = projectionMapsFor(image.size());
+    Mat projected;
+    remap(image, projected, maps.mapX, maps.mapY, INTER_LINEAR, BORDER_CONSTANT, Scalar(0,0,0));
+    return projected;
+}
+
+//Projects every input frame (gray, and colour unless the memory budget dropped it) and forgets everything computed
+//from the unprojected frames, including the features and retrieval vocabulary estimateFocal built
+void projectInputs(vector<Mat>& imgs, vector<Mat>& imgs_rgb) {
+    ScopedStage stage("project");
+    printf("Projecting %d frames with focal length %.1f...\n", (int)imgs.size(), focalLength);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < (int)imgs.size(); i++) {
+        imgs[i] = projectImage(imgs[i]);
+        if (!imgs_rgb[i].empty()) {
+            imgs_rgb[i] = projectImage(imgs_rgb[i]);
+        }
+        invalidateFeatures(i);
+        if (pyramidLevels > 0) {
+            pyramidImage(imgs, i, pyramidLevels);
+        }
+    }
+    inputsProjected = true;
+    avgMatchDistances.setTo(Scalar(-1));
+    retrievalVocabulary.release();
+    stage.set("tables", projectionMaps.size());
 }